@@ -93,6 +93,26 @@
 #define PLX9080_DMADAC0			0xb4
 #define PLX9080_DMADAC1			0xb8
 
+/* PLX 9080 DMA MODE REGISTER BITS */
+#define PLX9080_DMAMODE_CHAIN		(0x1 << 9)
+#define PLX9080_DMAMODE_DONE_INT	(0x1 << 10)
+#define PLX9080_DMAMODE_HOLD_LADR	(0x1 << 11)
+#define PLX9080_DMAMODE_DEMAND		(0x1 << 12)
+#define PLX9080_DMAMODE_INT_PCI		(0x1 << 17)
+
+/* PLX 9080 DMA DESCRIPTOR POINTER BITS */
+#define PLX9080_DMADPR_PCI_SPACE	(0x1 << 0)
+#define PLX9080_DMADPR_END_CHAIN	(0x1 << 1)
+#define PLX9080_DMADPR_TC_INT		(0x1 << 2)
+#define PLX9080_DMADPR_TO_PCI		(0x1 << 3)
+
+/* PLX 9080 DMA COMMAND/STATUS BITS */
+#define PLX9080_DMACSR_ENABLE		(0x1 << 0)
+#define PLX9080_DMACSR_START		(0x1 << 1)
+#define PLX9080_DMACSR_ABORT		(0x1 << 2)
+#define PLX9080_DMACSR_CLEAR_INT	(0x1 << 3)
+#define PLX9080_DMACSR_DONE		(0x1 << 4)
+
 /* PLX 9080 MESSAGING QUEUE REGISTERS */
 #define PLX9080_OPQIS			0x30
 #define PLX9080_OPQIM			0x34
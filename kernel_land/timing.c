@@ -37,16 +37,36 @@
 #include <linux/ktime.h>        /* measure time of DMA */
 #include <linux/kthread.h>      /* for the kthread */
 #include <linux/delay.h>        /* so the kthread can sleep */
+#include <linux/hrtimer.h>      /* refill timing */
+#include <linux/spinlock.h>     /* IRQ/timer/process DMA state */
 #include <linux/kdev_t.h>       /* kernel device type */
 #include <linux/cdev.h>         /* char device type */
 #include <linux/interrupt.h>    /* interrupts */
 #include <linux/dma-mapping.h>  /* DMA buffers */
+#include <linux/mm.h>           /* mmap of the DMA pool */
+#include <linux/scatterlist.h>  /* zero-copy user pages */
+#include <linux/mutex.h>        /* DO stream serialization */
+#include <linux/slab.h>         /* per card state */
+#include <linux/wait.h>         /* writers waiting on the queue */
+#include <linux/poll.h>         /* poll on the DO FIFO */
+#include <linux/bitmap.h>       /* pool buffers held per sequence */
+#include <linux/uio.h>          /* write_iter */
+#include <linux/sysfs.h>        /* stats attributes */
+#include <linux/debugfs.h>      /* latency histograms */
+#include <linux/seq_file.h>     /* ... and their output */
+#include <linux/percpu.h>       /* ... kept per CPU */
+#include <linux/list.h>         /* waveform cache LRU */
+#include <linux/kobject.h>      /* card lifetime */
+#include <linux/rwsem.h>        /* ... and file ops during remove */
 #include <asm/irq_vectors.h>    /* interrupts */
 #include <asm/byteorder.h>      /* ensure correct endianess */
 #include <asm/uaccess.h>        /* user access */
 #include "timing_kernel_defs.h" /* driver specific header */
 #include "_regs_PLX9080.h"
 
+#define CREATE_TRACE_POINTS
+#include "timing_trace.h"       /* tracepoints, once per module */
+
 #define MODULE_NAME "timing"
 
 #define MIN(a,b) (a < b ? a : b)
@@ -59,25 +79,79 @@ module_init(timing_dev_init);
 module_exit(timing_dev_exit);
 
 /* global data space */
-timing_dev_data  timing_card[TIMING_DEV_COUNT];
-timing_dev_data  *master_chip;
+timing_card_data *timing_cards[TIMING_MAX_CARDS];
 int              timing_maj_num;
-u8               irq_line;
-
-/* DMA helpers */
-u64 ns_clock_period;
-void *dma_virt_addr;
-dma_addr_t dma_bus_addr;
-size_t dma_size, total_size;
-struct pci_dev *dev_ptr;
-struct task_struct *dma_kthread;
-u64 dma_delay;
-int output_enabled, dma_waiting, dma_configured;
-s64 start_ns, end_ns;
+static DEFINE_MUTEX(timing_cards_lock);
+static struct dentry *timing_debug_root;
+
+/* refill timing */
 #define FIFO_SIZE 16384
-int fifo_width;
 #define ALMOST_EMPTY 15 /* in Ks FROM full */
 
+/* adaptive refill controller (see REFILL CONTROLLER) */
+static int adaptive_refill = 1;
+module_param(adaptive_refill, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adaptive_refill, "size refills from measured DMA time "
+		 "instead of the fixed ALMOST_EMPTY threshold");
+static int refill_margin_us = 100;
+module_param(refill_margin_us, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(refill_margin_us, "FIFO time kept in hand against underrun");
+static int refill_guard_words = 512;
+module_param(refill_guard_words, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(refill_guard_words, "FIFO words kept free against overrun");
+
+/* stream statistics (see STREAM STATISTICS) */
+static int near_miss_us = 200;
+module_param(near_miss_us, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(near_miss_us, "refills started with less FIFO time than "
+		 "this left count as near misses");
+
+/* chained (scatter/gather) DMA helpers */
+static int dma_chain = 0;
+module_param(dma_chain, int, S_IRUGO);
+MODULE_PARM_DESC(dma_chain, "non-zero sends each FIFO write as a single "
+		 "PLX9080 descriptor chain paced by the card (demand mode)");
+
+/* sequences queued behind the one playing */
+static int queue_depth = 4;
+module_param(queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "sequences that can be queued on the DO FIFO "
+		 "(power of 2, 1 to 16) before write blocks");
+
+/* persistent DMA pool, allocated once at probe time */
+static int pool_bufs = 32;
+module_param(pool_bufs, int, S_IRUGO);
+MODULE_PARM_DESC(pool_bufs, "number of coherent DMA buffers in the pool");
+static int pool_buf_kb = 256;
+module_param(pool_buf_kb, int, S_IRUGO);
+MODULE_PARM_DESC(pool_buf_kb, "size of each DMA pool buffer in KB");
+
+/* segments making up the sequence being sent */
+static int max_segs = 1024;
+module_param(max_segs, int, S_IRUGO);
+MODULE_PARM_DESC(max_segs, "most segments (chain descriptors) one "
+		 "zero-copy write may be split into");
+
+/* DI capture ring on DMA channel 0 */
+static int di_blocks = 16;
+module_param(di_blocks, int, S_IRUGO);
+MODULE_PARM_DESC(di_blocks, "blocks in the DI capture ring, 0 for none");
+static int di_block_kb = 64;
+module_param(di_block_kb, int, S_IRUGO);
+MODULE_PARM_DESC(di_block_kb, "size of each DI capture block in KB");
+
+/* sequences kept in driver memory to be played by id */
+static int wave_cache_kb = 16384;
+module_param(wave_cache_kb, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wave_cache_kb, "most memory in KB the waveform cache of "
+		 "a card may hold; idle waves are evicted LRU first");
+
+/* raw register access from user space */
+static int bar_mmap = 0;
+module_param(bar_mmap, int, S_IRUGO);
+MODULE_PARM_DESC(bar_mmap, "non-zero lets CAP_SYS_RAWIO processes mmap "
+		 "the register BARs through the register devices");
+
 /* pci struct to register with kernel */
 /*     so kernel can pair with device */
 static struct pci_device_id timing_id[] = {
@@ -97,9 +171,12 @@ static struct pci_driver timing_driver = {
 /* register as char device to read/write */
 struct file_operations timing_fops = {
   .owner            = THIS_MODULE,
-  .read             = timing_read,
-  .write            = timing_write,
-  .unlocked_ioctl   = timing_ioctl,
+  .read             = timing_live_read,
+  .write            = timing_live_write,
+  .write_iter       = timing_live_write_iter,
+  .unlocked_ioctl   = timing_live_ioctl,
+  .mmap             = timing_live_mmap,
+  .poll             = timing_live_poll,
   .open             = timing_dev_open,
   .release          = timing_dev_release
 };
@@ -119,16 +196,16 @@ struct file_operations timing_fops = {
 /* function called at module load time */
 static int __init timing_dev_init(void) {
 
-  int i, rc;
+  int rc;
   dev_t dev_num;
 
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_init entry\n");
  #endif
 
-  /* dynamically assign device number */
+  /* dynamically assign device numbers, a range per card */
   rc = alloc_chrdev_region(&dev_num, FIRST_MINOR,
-			   TIMING_DEV_COUNT, MODULE_NAME);
+			   TIMING_MAX_CARDS * TIMING_DEV_COUNT, MODULE_NAME);
   if (rc) {
     printk(KERN_ALERT "Error allocating dev numbers - timing.c\n");
     return rc;
@@ -137,81 +214,41 @@ static int __init timing_dev_init(void) {
   /* record major number */
   timing_maj_num = MAJOR(dev_num);
 
-  /* set up individual data for each char dev */
-  /*     for the 8 IO Ports                   */
-  for ( i = 0; i < TIMING_DEV_COUNT; i++ ) {
-    
-    timing_card[i].offset = 0x00;
-
-    /* device number */
-    timing_card[i].num = MKDEV(timing_maj_num, FIRST_MINOR + i);
-
-    /* part of device that this addresses */
-    if ( i < TIMING_IOPORT_COUNT )
-      timing_card[i].component = PCI7300_ID;
-    else if ( i < TIMING_IOPORT_COUNT + TIMING_8254_COUNT )
-      timing_card[i].component = TIMER8254_ID;
-    else 
-      timing_card[i].component = PLX9080_ID;
-    
-    /* vital driver structures */
-    timing_card[i].driver = &timing_driver;
-    timing_card[i].fops   = &timing_fops  ;
-
-    /* set up actual cdev */
-    cdev_init(&timing_card[i].cdev, &timing_fops);
-    timing_card[i].cdev.owner = THIS_MODULE;
-    timing_card[i].cdev.ops = &timing_fops;
+  /* each card adds its histograms below this */
+  timing_debug_root = debugfs_create_dir(MODULE_NAME, NULL);
 
-    /* actual cdev registration */ /* magic # 1 is "count" */
-    rc = cdev_add(&timing_card[i].cdev, timing_card[i].num, 1);
+  /* char devices are added as each card is probed */
+  rc = pci_register_driver(&timing_driver);
+  if ( rc ) {
+    printk(KERN_ALERT "Error registering timing PCI driver\n");
+    debugfs_remove_recursive(timing_debug_root);
+    unregister_chrdev_region(dev_num, TIMING_MAX_CARDS * TIMING_DEV_COUNT);
+    return rc;
+  }
 
-    if ( rc < 0 ) {
-      printk(KERN_ALERT "Error adding timing cdev %d to sys\n", i);
-      goto del_cdev;
-    }
-  } /* end data initialization for IO port loop */
-  
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_init() exit success\n");
  #endif
 
-  /* finally, register as pci dev */
-  /* END FLOW OF NORMAL OPERATION */
-  return pci_register_driver(&timing_driver);
-
-  /* ERROR HANDLING */
- del_cdev:
-
-  /* unregister char drivers */
-  unregister_chrdev_region(dev_num, TIMING_DEV_COUNT);
-
-  /* delete the cdevs that succeeded (up to i) */
-  for ( ; !(i < 0); i-- )
-    cdev_del(&timing_card[i].cdev);
-
-  return rc;
+  return 0;
 } /* end timing_init */
 
 /* function called at module unload time */
 static void __exit timing_dev_exit(void) {
 
-  int i;
-
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_exit() entry\n");
  #endif
 
-  /* unregister char drivers */
-  unregister_chrdev_region(timing_card[0].num, TIMING_DEV_COUNT);
-  
-  /* remove char drivers from system */
-  for ( i = 0; i < TIMING_DEV_COUNT; i++ )
-    cdev_del(&timing_card[i].cdev);
-
-  /* unregister PCI driver */
+  /* unregister PCI driver, removes every card */
   pci_unregister_driver(&timing_driver);
 
+  debugfs_remove_recursive(timing_debug_root);
+
+  /* unregister char drivers */
+  unregister_chrdev_region(MKDEV(timing_maj_num, FIRST_MINOR),
+			   TIMING_MAX_CARDS * TIMING_DEV_COUNT);
+
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_exit exit normal\n");
  #endif
@@ -235,50 +272,130 @@ irqreturn_t timing_interrupt_handler(int irq, void *dev_id) {
   
   u8  tmp8;
   u32 tmp32;
+  timing_card_data *card = dev_id;
+
+  irqreturn_t handled = IRQ_NONE;
+
+  tmp8  = ioread8( card->port[12].base + PLX9080_DMACSR1 );
+  tmp32 = ioread32(card->port[12].base + PLX9080_INTCSR  );
 
-  tmp8  = ioread8( timing_card[12].base + PLX9080_DMACSR1 );
-  tmp32 = ioread32(timing_card[12].base + PLX9080_INTCSR  );
+  /* DI capture filled one or more blocks */
+  if ( tmp32 & (0x1 << 21) ) {
+    di_interrupt(card);
+    handled = IRQ_HANDLED;
+  }
+
+  /* chain passed the end of a cycle and carries on */
+  if ( !(tmp8 & (0x1 << 4)) && (tmp32 & (0x1 << 22)) && dma_chain ) {
+
+    iowrite8(PLX9080_DMACSR_ENABLE | PLX9080_DMACSR_CLEAR_INT,
+	     card->port[12].base + PLX9080_DMACSR1);
+
+    spin_lock(&card->dma_lock);
+    if ( card->dma_running ) {
+      stats_sample(card, card->dma_size);
+      dma_chain_cycle(card);
+    }
+    spin_unlock(&card->dma_lock);
+
+    return IRQ_HANDLED;
+  }
 
   /* if interrupt occured from DMA and DMA is done (sanity check) */
   if ( (tmp8  & (0x1 << 4 )) && (tmp32 & (0x1 << 22)) ) {
 
-    end_ns = ktime_to_ns(ktime_get());
-    
-    printk(KERN_DEBUG "%u bytes moved in %lld microseconds\n",
-	   (unsigned) dma_size, end_ns - start_ns );
+    card->end_ns = ktime_to_ns(ktime_get());
+    hist_add(card, HIST_DMA_TIME, card->end_ns - card->start_ns);
+    trace_timing_dma_done(card->index, card->dma_size,
+			  card->end_ns - card->start_ns);
 
-    if ( !dma_configured )
-      configure_for_dma();
+    if ( !card->dma_configured )
+      configure_for_dma(card);
 
     /* clear interrupt status */
     iowrite8( tmp8 | (0x1 << 3), 
-	      timing_card[12].base + PLX9080_DMACSR1 );
+	      card->port[12].base + PLX9080_DMACSR1 );
+
+    spin_lock(&card->dma_lock);
+
+    /* stream was stopped under us */
+    if ( !card->dma_running ) {
+      spin_unlock(&card->dma_lock);
+      return IRQ_HANDLED;
+    }
+
+    stats_sample(card, card->dma_size);
+
+    /* chain ran out, nothing to refill */
+    if ( dma_chain ) {
+      dma_chain_done(card);
+      spin_unlock(&card->dma_lock);
+      return IRQ_HANDLED;
+    }
+
+    /* done with previous transfer */
+    card->total_size -= card->dma_size;
     
-    /* calculate the delay */
-    dma_delay = ns_clock_period * ALMOST_EMPTY * 1024;
+    if ( adaptive_refill && card->ns_clock_period && card->fifo_width ) {
 
-    /* adjust delay as appropriate */
-    if ( dma_delay < (end_ns - start_ns) )
-      dma_delay = 0;
-    else
-      dma_delay -= (end_ns - start_ns);
+      /* learn from this transfer, size the next one */
+      refill_update(card, card->dma_size, card->end_ns - card->start_ns);
+      refill_plan(card);
+    }
+    else {
 
-    /* begin new transfer or set flag */
-    if ( output_enabled ) 
-      wake_up_process(dma_kthread);
-    else 
-      dma_waiting = 1;
-      
+      /* calculate the delay */
+      card->dma_delay = card->ns_clock_period * ALMOST_EMPTY * 1024;
+
+      /* adjust delay as appropriate */
+      if ( card->dma_delay < (card->end_ns - card->start_ns) )
+	card->dma_delay = 0;
+      else
+	card->dma_delay -= (card->end_ns - card->start_ns);
+
+      card->refill.next_bytes = 4 * ALMOST_EMPTY * 1024;
+    }
+
+    trace_timing_dma_delay(card->index, card->dma_delay,
+			   card->refill.next_bytes, card->refill.level_words,
+			   card->refill.low_words);
+
+    /* sequence done, repeat it or go on to the next */
+    if ( !card->total_size )
+      dma_next_cycle(card);
+
+    if ( card->total_size > 0 ) {
+
+      /* assign next transfer size, from the segments */
+      card->dma_size = dma_next_chunk(card, card->refill.next_bytes);
+
+      /* time the next transfer or wait for output */
+      if ( card->output_enabled ) 
+	refill_arm(card, card->end_ns);
+      else 
+	card->dma_waiting = 1;
+    }
+    else {
+      card->dma_running = 0;
+      if ( card->output_enabled )
+	card->stats.stalls++;
+    }
+
+    spin_unlock(&card->dma_lock);
+
+    return IRQ_HANDLED;
   }
   
-  return IRQ_HANDLED;
-}
+  /* line is shared, possibly with another timing card */
+  return handled;
+} /* end timing_interrupt_handler */
 
 /* called when kernel matches PCI hardware to this module */
 static int timing_dev_probe(struct pci_dev *dev, 
 			    const struct pci_device_id *id) {
 
   int rc, i, j;
+  timing_card_data *card;
 
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_probe() entry\n");
@@ -309,38 +426,58 @@ static int timing_dev_probe(struct pci_dev *dev,
 
   /* NOW WE ARE DEALING WITH THE TIMING CARD */
 
+  card = kzalloc(sizeof(timing_card_data), GFP_KERNEL);
+  if ( !card ) {
+    rc = -ENOMEM;
+    goto no_card;
+  }
+
+  /* freed by timing_card_release on the last put */
+  kobject_init(&card->kobj, &timing_card_ktype);
+  INIT_LIST_HEAD(&card->waves);
+  init_rwsem(&card->gone_sem);
+
+  /* claim the first free slot, it decides the minors */
+  mutex_lock(&timing_cards_lock);
+  for ( i = 0; i < TIMING_MAX_CARDS && timing_cards[i]; i++ )
+    ;
+  if ( i < TIMING_MAX_CARDS )
+    timing_cards[i] = card;
+  mutex_unlock(&timing_cards_lock);
+
+  if ( i == TIMING_MAX_CARDS ) {
+    printk(KERN_ALERT "Timing driver handles at most %d cards\n",
+	   TIMING_MAX_CARDS);
+    rc = -EBUSY;
+    goto no_slot;
+  }
+
   /* simple initialization */
-  dev_ptr = dev;
-  dma_waiting = 0;
-  dma_configured = 0;
-  output_enabled = 0;
+  card->index = i;
+  card->pdev = pci_dev_get(dev);
+  spin_lock_init(&card->dma_lock);
+  mutex_init(&card->dma_mutex);
+  mutex_init(&card->reg_mutex);
+  init_waitqueue_head(&card->queue_wait);
+  spin_lock_init(&card->di_lock);
+  mutex_init(&card->di_mutex);
+  init_waitqueue_head(&card->di_wait);
+  card->wave_next_id = 1;
+  atomic_set(&card->pool_maps, 0);
+  card->cycles = 1;
+  card->stats.min_margin_ns = -1;
 
   /* enable DMA */
   pci_set_master(dev);
 
   if ( pci_set_dma_mask(dev, DMA_BIT_MASK(32)) ) {
     printk(KERN_ALERT "DMA NOT SUPPORTED: Aboting.");
-    return -ENODEV; /* not the device we expected */
+    rc = -ENODEV; /* not the device we expected */
+    goto request_fail;
   }
   else
     printk(KERN_WARNING "Doing DMA with 32 bits\n");
 
-  /* retrieve assigned interrupt line number */
-  /*      -> see linux/pci.h lines 255 & 256 */
-  irq_line = dev->irq;
-
-  /* request interrupt line number */
-  /*    -> common practice says to put this */
-  /*       in device open but this could be */
-  /*       needed if the user closes the    */
-  /*       device before DMA transfer done  */
-  rc = request_irq(irq_line, timing_interrupt_handler,
-                   IRQF_SHARED, "timing", timing_card);
-  if ( rc ) {
-    printk(KERN_ALERT "Failed to register irq %d\n", irq_line);
-    return rc;
-  }
-
   /* must claim proprietary access to memory region */
   /*      mapped to the device                      */
   rc = pci_request_regions(dev, timing_driver.name);
@@ -352,36 +489,156 @@ static int timing_dev_probe(struct pci_dev *dev,
   /* retrieve base address of mmapped regions */
   /*      -> common practice avoids reading   */
   /*         the PCI config space directly    */
-  timing_card[0].len = pci_resource_len(dev, TIMING_BAR);
-  timing_card[0].base = pci_iomap(dev, TIMING_BAR, 
-          /* +1 for maxlen */  timing_card[0].len + 1);
+  card->port[0].len = pci_resource_len(dev, TIMING_BAR);
+  card->port[0].base = pci_iomap(dev, TIMING_BAR, 
+          /* +1 for maxlen */  card->port[0].len + 1);
   
-  if (!timing_card[0].base) {
+  if (!card->port[0].base) {
     printk(KERN_ALERT "Failed to find Timing base address\n");
     rc = -ENODEV; /* no device error */
     goto no_base;
   }
 
-  /* already did this for timing_card[0] */
+  /* already did this for port[0] */
   i = 1;
 
   /* init other IO port vals */
   for ( j = 1; j < TIMING_IOPORT_COUNT; j++, i++ ) {
-    timing_card[i].len  = timing_card[0].len;
-    timing_card[i].base = timing_card[0].base + (i*TIMING_IOPORT_SIZE);
+    card->port[i].len  = card->port[0].len;
+    card->port[i].base = card->port[0].base + (i*TIMING_IOPORT_SIZE);
   }
 
   /* and onboard timer vals */
   for ( j = 0; j < TIMING_8254_COUNT; j++, i++ ) {
-    timing_card[i].len  = timing_card[0].len;
-    timing_card[i].base = timing_card[0].base + (i*TIMING_IOPORT_SIZE);
+    card->port[i].len  = card->port[0].len;
+    card->port[i].base = card->port[0].base + (i*TIMING_IOPORT_SIZE);
   }
 
   /* finally, set up for Bus Mater (LCR) (PLX9080) */
-  timing_card[i].len = pci_resource_len(dev, PLX9080_BAR);
-  timing_card[i].base = pci_iomap(dev, PLX9080_BAR, 
-        /* +1 for maxlen */  timing_card[i].len + 1);
-  master_chip = &timing_card[i];
+  card->port[i].len = pci_resource_len(dev, PLX9080_BAR);
+  card->port[i].base = pci_iomap(dev, PLX9080_BAR, 
+        /* +1 for maxlen */  card->port[i].len + 1);
+  card->master_chip = &card->port[i];
+
+  if ( !card->master_chip->base ) {
+    printk(KERN_ALERT "Failed to find PLX9080 base address\n");
+    rc = -ENODEV;
+    goto no_lcr;
+  }
+
+  /* refills are started from this timer */
+  hrtimer_init(&card->refill_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  card->refill_timer.function = refill_timer_fn;
+
+  /* re-initialised with the caller's clock by TIMING_IOC_START_AT */
+  hrtimer_init(&card->start_timer, CLOCK_REALTIME, HRTIMER_MODE_ABS_HARD);
+  card->start_timer.function = start_timer_fn;
+
+  /* DMA buffers live as long as the card does */
+  rc = dma_pool_alloc(card);
+  if ( rc )
+    goto no_pool;
+
+  /* DI capture lands here */
+  rc = di_ring_alloc(card);
+  if ( rc )
+    goto no_di;
+
+  /* latency histograms, one set per CPU */
+  card->hist = alloc_percpu(timing_hist);
+  if ( !card->hist ) {
+    rc = -ENOMEM;
+    goto no_hist;
+  }
+
+  /* reaps the sequences the stream is done with */
+  card->dma_kthread = kthread_run(dma_init_kthread, card,
+				  "timing%d_dma", card->index);
+  if ( IS_ERR(card->dma_kthread) ) {
+    rc = PTR_ERR(card->dma_kthread);
+    goto no_kthread;
+  }
+
+  /* retrieve assigned interrupt line number */
+  /*      -> see linux/pci.h lines 255 & 256 */
+  card->irq_line = dev->irq;
+
+  /* request interrupt line number */
+  /*    -> common practice says to put this */
+  /*       in device open but this could be */
+  /*       needed if the user closes the    */
+  /*       device before DMA transfer done  */
+  /*    -> the handler reads the LCR, so    */
+  /*       the line is shared only once it  */
+  /*       is mapped                        */
+  rc = request_irq(card->irq_line, timing_interrupt_handler,
+                   IRQF_SHARED, "timing", card);
+  if ( rc ) {
+    printk(KERN_ALERT "Failed to register irq %d\n", card->irq_line);
+    goto no_irq;
+  }
+
+  /* set up individual data for each char dev */
+  for ( i = 0; i < TIMING_DEV_COUNT; i++ ) {
+
+    card->port[i].offset = 0x00;
+    card->port[i].card   = card;
+
+    /* device number, in this card's range */
+    card->port[i].num = MKDEV(timing_maj_num, FIRST_MINOR + 
+			      card->index * TIMING_DEV_COUNT + i);
+
+    /* part of device that this addresses */
+    if ( i < TIMING_IOPORT_COUNT )
+      card->port[i].component = PCI7300_ID;
+    else if ( i < TIMING_IOPORT_COUNT + TIMING_8254_COUNT )
+      card->port[i].component = TIMER8254_ID;
+    else 
+      card->port[i].component = PLX9080_ID;
+    
+    /* vital driver structures */
+    card->port[i].driver = &timing_driver;
+    card->port[i].fops   = &timing_fops  ;
+
+    /* set up actual cdev */
+    cdev_init(&card->port[i].cdev, &timing_fops);
+    card->port[i].cdev.owner = THIS_MODULE;
+    card->port[i].cdev.ops = &timing_fops;
+
+    /* an open file keeps the card through its cdev */
+    cdev_set_parent(&card->port[i].cdev, &card->kobj);
+
+    /* actual cdev registration */ /* magic # 1 is "count" */
+    rc = cdev_add(&card->port[i].cdev, card->port[i].num, 1);
+
+    if ( rc < 0 ) {
+      printk(KERN_ALERT "Error adding timing cdev %d to sys\n", i);
+      goto del_cdev;
+    }
+  } /* end data initialization for IO port loop */
+
+  pci_set_drvdata(dev, card);
+
+  /* counters under /sys/bus/pci/devices/.../stats */
+  rc = sysfs_create_group(&dev->dev.kobj, &timing_stats_group);
+  if ( rc ) {
+    printk(KERN_ALERT "Failed to create timing stats in sysfs\n");
+    goto del_cdev;
+  }
+
+  /* where this card's minors start, for timing_mknod.sh */
+  rc = device_create_file(&dev->dev, &dev_attr_minor_base);
+  if ( rc ) {
+    printk(KERN_ALERT "Failed to create timing minor_base in sysfs\n");
+    sysfs_remove_group(&dev->dev.kobj, &timing_stats_group);
+    goto del_cdev;
+  }
+
+  hist_debugfs_init(card);
+
+  printk(KERN_WARNING "timing: card %d at minors %d-%d\n", card->index,
+	 FIRST_MINOR + card->index * TIMING_DEV_COUNT,
+	 FIRST_MINOR + card->index * TIMING_DEV_COUNT + TIMING_DEV_COUNT - 1);
 
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_probe() exit success\n");
@@ -391,36 +648,114 @@ static int timing_dev_probe(struct pci_dev *dev,
   return 0;
 
   /* ERROR HANDLING */
+ del_cdev:
+  /* delete the cdevs that succeeded (before i) */
+  while ( --i >= 0 )
+    cdev_del(&card->port[i].cdev);
+
+  free_irq(card->irq_line, card);
+
+ no_irq:
+  kthread_stop(card->dma_kthread);
+
+ no_kthread:
+  free_percpu(card->hist);
+
+ no_hist:
+  di_ring_free(card);
+
+ no_di:
+  dma_pool_free(card);
+
+ no_pool:
+  pci_iounmap(dev, card->master_chip->base);
+
+ no_lcr:
+  pci_iounmap(dev, card->port[0].base);
+
  no_base:
   pci_release_regions(dev);
   
  request_fail:
-  pci_disable_device(dev);
-
   pci_clear_master(dev);
 
+  mutex_lock(&timing_cards_lock);
+  timing_cards[card->index] = NULL;
+  mutex_unlock(&timing_cards_lock);
+
+ no_slot:
+  kobject_put(&card->kobj);
+
+ no_card:
+  pci_disable_device(dev);
+
   return rc;
 } /* end timing_dev_probe */
 
 /* called when PCI device is removed or module unloaded */
 static void timing_dev_remove(struct pci_dev *dev) {
 
+  int i;
+  timing_card_data *card;
+
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_remove() entry\n");
  #endif
 
+  card = pci_get_drvdata(dev);
+
+  /* file ops fail from here on, wake those asleep in one */
+  WRITE_ONCE(card->gone, 1);
+
+  mutex_lock(&card->dma_mutex);
+  dma_stop_stream(card);
+  mutex_unlock(&card->dma_mutex);
+  wake_up_interruptible(&card->queue_wait);
+
+  mutex_lock(&card->di_mutex);
+  di_stop(card);
+  mutex_unlock(&card->di_mutex);
+
+  /* and wait for them to leave */
+  down_write(&card->gone_sem);
+  up_write(&card->gone_sem);
+
+  debugfs_remove_recursive(card->debug_dir);
+  device_remove_file(&dev->dev, &dev_attr_minor_base);
+  sysfs_remove_group(&dev->dev.kobj, &timing_stats_group);
+
+  /* no new opens of this card's devices */
+  for ( i = 0; i < TIMING_DEV_COUNT; i++ )
+    cdev_del(&card->port[i].cdev);
+
+  /* stop the channels while the LCR is still mapped, */
+  /* in case an op got in before gone was set          */
+  mutex_lock(&card->dma_mutex);
+  dma_stop_stream(card);
+  mutex_unlock(&card->dma_mutex);
+
+  mutex_lock(&card->di_mutex);
+  di_stop(card);
+  mutex_unlock(&card->di_mutex);
+
+  kthread_stop(card->dma_kthread);
+  free_percpu(card->hist);
+
   /* release resources */
-  free_irq(irq_line, timing_card);
-  pci_iounmap(dev, timing_card[0].base);
-  pci_iounmap(dev, master_chip->base);
+  free_irq(card->irq_line, card);
+  pci_iounmap(dev, card->port[0].base);
+  pci_iounmap(dev, card->master_chip->base);
   pci_release_regions(dev);
   pci_clear_master(dev);
   pci_disable_device(dev);
 
-  if ( dma_kthread ) {
-    kthread_stop(dma_kthread);
-    wake_up_process(dma_kthread);
-  }
+  /* slot (and its minors) can go to the next card probed */
+  mutex_lock(&timing_cards_lock);
+  timing_cards[card->index] = NULL;
+  mutex_unlock(&timing_cards_lock);
+
+  /* memory goes with the last open file or mapping */
+  kobject_put(&card->kobj);
 
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_dev_remove() exit success\n");
@@ -441,6 +776,151 @@ static void timing_dev_remove(struct pci_dev *dev) {
 /*             *************             */
 /*                 *****                 */
 
+/*
+   Release of the card's kobject, once the probe's reference,
+   every cdev (and so every open file) and every mapping of
+   card memory are gone. What user space can still map is
+   only freed here; the hardware went in timing_dev_remove.
+ */
+static void timing_card_release(struct kobject *kobj) {
+
+  timing_card_data *card;
+
+  card = container_of(kobj, timing_card_data, kobj);
+
+  wave_cache_free(card);
+  di_ring_free(card);
+  dma_pool_free(card);
+
+  if ( card->pdev )
+    pci_dev_put(card->pdev);
+
+  kfree(card);
+
+  return;
+} /* end timing_card_release */
+
+static struct kobj_type timing_card_ktype = {
+  .release = timing_card_release,
+};
+
+/*
+   File ops go through these. Once timing_dev_remove has set
+   gone they fail with -ENODEV, and remove waits on gone_sem
+   for those already in to leave before it lets go of the
+   hardware.
+ */
+static int timing_enter(timing_card_data *card) {
+
+  down_read(&card->gone_sem);
+
+  if ( READ_ONCE(card->gone) ) {
+    up_read(&card->gone_sem);
+    return -ENODEV;
+  }
+
+  return 0;
+} /* end timing_enter */
+
+static void timing_leave(timing_card_data *card) {
+
+  up_read(&card->gone_sem);
+
+  return;
+} /* end timing_leave */
+
+static timing_card_data *timing_file_card(struct file *filp) {
+
+  return ((timing_dev_data *)filp->private_data)->card;
+} /* end timing_file_card */
+
+static ssize_t timing_live_read(struct file *filp, char __user *buf,
+				size_t count, loff_t *f_pos) {
+
+  ssize_t rc;
+  timing_card_data *card = timing_file_card(filp);
+
+  rc = timing_enter(card);
+  if ( rc )
+    return rc;
+  rc = timing_read(filp, buf, count, f_pos);
+  timing_leave(card);
+
+  return rc;
+} /* end timing_live_read */
+
+static ssize_t timing_live_write(struct file *filp, const char __user *buf,
+				 size_t count, loff_t *f_pos) {
+
+  ssize_t rc;
+  timing_card_data *card = timing_file_card(filp);
+
+  rc = timing_enter(card);
+  if ( rc )
+    return rc;
+  rc = timing_write(filp, buf, count, f_pos);
+  timing_leave(card);
+
+  return rc;
+} /* end timing_live_write */
+
+static ssize_t timing_live_write_iter(struct kiocb *iocb,
+				      struct iov_iter *from) {
+
+  ssize_t rc;
+  timing_card_data *card = timing_file_card(iocb->ki_filp);
+
+  rc = timing_enter(card);
+  if ( rc )
+    return rc;
+  rc = timing_write_iter(iocb, from);
+  timing_leave(card);
+
+  return rc;
+} /* end timing_live_write_iter */
+
+static long timing_live_ioctl(struct file *filp, unsigned int cmd,
+			      unsigned long arg) {
+
+  long rc;
+  timing_card_data *card = timing_file_card(filp);
+
+  rc = timing_enter(card);
+  if ( rc )
+    return rc;
+  rc = timing_ioctl(filp, cmd, arg);
+  timing_leave(card);
+
+  return rc;
+} /* end timing_live_ioctl */
+
+static int timing_live_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+  int rc;
+  timing_card_data *card = timing_file_card(filp);
+
+  rc = timing_enter(card);
+  if ( rc )
+    return rc;
+  rc = timing_mmap(filp, vma);
+  timing_leave(card);
+
+  return rc;
+} /* end timing_live_mmap */
+
+static __poll_t timing_live_poll(struct file *filp, poll_table *wait) {
+
+  __poll_t mask;
+  timing_card_data *card = timing_file_card(filp);
+
+  if ( timing_enter(card) )
+    return EPOLLERR | EPOLLHUP;
+  mask = timing_poll(filp, wait);
+  timing_leave(card);
+
+  return mask;
+} /* end timing_live_poll */
+
 /* called when the char device is opened */
 static int timing_dev_open(struct inode *inode, 
 			   struct file  *filp ) {
@@ -488,6 +968,7 @@ static ssize_t timing_read(struct file *filp, char __user *buf,
   u8 tmp8;
   u32 tmp32;
   timing_dev_data *my_dev;
+  timing_card_data *card;
   
  #if DEBUG != 0
   printk(KERN_DEBUG "timing_read() entry\n");
@@ -495,6 +976,11 @@ static ssize_t timing_read(struct file *filp, char __user *buf,
 
   /* which device is being accessed? */
   my_dev = filp->private_data;
+  card = my_dev->card;
+
+  /* DI FIFO streams from the capture ring once it is started */
+  if ( my_dev == &card->port[4] && di_active(card) )
+    return di_read(card, filp, buf, count);
 
   if ( my_dev->component == PCI7300_ID && count != 4 ) {
     printk(KERN_ALERT "PCI7300 Registers are 4 bytes wide\n");
@@ -525,357 +1011,3684 @@ static ssize_t timing_read(struct file *filp, char __user *buf,
   printk(KERN_DEBUG "timing_read() exit success\n");
  #endif
 
-  return 0;
+  return count;
 } /* end of timing_read */
 
-/* kthread function to start a new DMA transfer */
-/* NOTE: doesn't handle new transfer while old is running. */
+/*
+   kthread for the parts of a stream that can't run in
+   interrupt context. Refills are started by the hrtimer;
+   this gives back the pool buffers and user pages of the
+   sequences the stream has finished with, which frees
+   their queue slots for writers waiting on them.
+*/
 int dma_init_kthread(void *data) {
 
-  ssize_t last_size;
-  last_size = 0;
-  
-  while ( !kthread_should_stop() ) {
+  s64 woke_ns;
+  unsigned long flags;
+  timing_card_data *card = data;
 
-    /* done with previous transfer */
-    total_size -= dma_size;
+  while ( 1 ) {
 
-    /* unmap last DMA mapping */
-    pci_unmap_single(dev_ptr, dma_bus_addr, 
-		     dma_size, PCI_DMA_TODEVICE);
+    set_current_state(TASK_INTERRUPTIBLE);
 
-    if ( total_size > 0 ) {
-      
-      /* update transfered size thus far */
-      last_size += dma_size;
-
-      /* assign next transfer size */
-      dma_size = MIN(total_size, 4 * ALMOST_EMPTY * 1024);
-
-      /* map next DMA buffer */
-      dma_bus_addr = pci_map_single(dev_ptr, dma_virt_addr + last_size, 
-				    dma_size, PCI_DMA_TODEVICE);
-
-     #if DEBUG != 0
-      printk(KERN_DEBUG "NEXT DMA TRANSFER OF SIZE %u, "
-	     "offset last_size %u, DELAY %u microseconds\n", 
-	     (unsigned)dma_size, (unsigned)last_size, 
-	     (unsigned)dma_delay);
-     #endif
-    }  
-    else {
-      kfree(dma_virt_addr);
-      goto sleep;
-    }
+    if ( kthread_should_stop() )
+      break;
 
-    /* wait for FIFO to deplete to start transfer */
-    if ( dma_delay ) {
-      dma_delay /= 1000; /* ns -> ~us */
-      usleep_range(dma_delay - 1, dma_delay);
+    if ( READ_ONCE(card->q_reap) == READ_ONCE(card->q_head) ) {
+      schedule();
+      continue;
     }
 
-    /* clear interrupts and disable DMA */
-    iowrite8(0x08, timing_card[12].base + 0xa9);
-    iowrite8(0x00, timing_card[12].base + 0xa9);
+    __set_current_state(TASK_RUNNING);
+
+    /* how long since the interrupt asked for us */
+    spin_lock_irqsave(&card->dma_lock, flags);
+    woke_ns = card->wake_ns;
+    card->wake_ns = 0;
+    spin_unlock_irqrestore(&card->dma_lock, flags);
+    if ( woke_ns ) {
+      woke_ns = ktime_to_ns(ktime_get()) - woke_ns;
+      hist_add(card, HIST_WAKE, woke_ns);
+      trace_timing_kthread_wake(card->index, woke_ns);
+    }
 
-    /* Mode - 32 bit bus, don't increment local addr, enable interrupt */
-    iowrite32(cpu_to_le32(0x00020c01),   timing_card[12].base + 0x94); 
+    mutex_lock(&card->dma_mutex);
+    dma_queue_reap(card);
+    mutex_unlock(&card->dma_mutex);
+  }
 
-    /* PCI and local bus addresses, transfer count, transfer direction */
-    iowrite32(cpu_to_le32(dma_bus_addr), timing_card[12].base + 0x98);
-    iowrite32(cpu_to_le32(0x14),         timing_card[12].base + 0x9c);
-    iowrite32(cpu_to_le32(dma_size),     timing_card[12].base + 0xa0);
-    iowrite32(0x00,                      timing_card[12].base + 0xa4);
+  __set_current_state(TASK_RUNNING);
 
-    /* Enable DMA */
-    iowrite8( 0x01, timing_card[12].base + 0xa9);
- 
-    /* Start DMA, record start time */
-    iowrite8( 0x03, timing_card[12].base + 0xa9);
-    start_ns = ktime_to_ns(ktime_get());
-    
-   sleep:
-    set_current_state(TASK_INTERRUPTIBLE);
-    schedule();
-  }
-  
   /* I am dying now */
   return 0;
 } /* end kthread function */
 
-/* function to initiate a DMA transfer */
-static ssize_t dma_transfer(struct file *filp, const char __user *buf,
-          size_t count, loff_t *f_pos) {
-
-  int rc;
-  u32 tmp32;
+/* 
+   Start the refill timer for the current dma_delay, measured
+   from base_ns: the instant the FIFO level model was last
+   valid and draining. A delay already past starts right away.
+   dma_lock held.
+*/
+static void refill_arm(timing_card_data *card, s64 base_ns) {
 
- #if DEBUG != 0
-  printk(KERN_DEBUG "dma_transfer() entry\n");
- #endif
+  card->refill.due_ns = base_ns + card->dma_delay;
+  card->refill.due_set = 1;
 
-  /* kill old kthread */
-  if ( dma_kthread ) {
-    kthread_stop(dma_kthread);
-    wake_up_process(dma_kthread);
-  }
-  /* start new kthread */
-  dma_kthread = kthread_create(dma_init_kthread, NULL, "dma_kthread");
-  
-  /* initialize first DMA transfer */
-  total_size = count;
-  dma_size = MIN(count, FIFO_SIZE * fifo_width);
-  dma_virt_addr = kmalloc(total_size, GFP_KERNEL | GFP_DMA);
-  dma_bus_addr = pci_map_single(dev_ptr, dma_virt_addr, dma_size, 
-				PCI_DMA_TODEVICE);
-
-  /* get data */
-  rc = copy_from_user(dma_virt_addr, buf, count);
-  if (rc) {
-    printk(KERN_ALERT "timing_write() bad copy_from_user\n");
-    return -EFAULT;
+  if ( card->refill.due_ns <= ktime_to_ns(ktime_get()) ) {
+    dma_refill_kick(card);
+    return;
   }
 
-  /* enable interrupts from DMA done activity */
-  tmp32 = ioread32(timing_card[12].base + PLX9080_INTCSR);
-  iowrite32( tmp32 | ( 0x1 << 8 ) | ( 0x1 << 19 ),
-	     timing_card[12].base + PLX9080_INTCSR);
+  hrtimer_start(&card->refill_timer, ns_to_ktime(card->refill.due_ns),
+		HRTIMER_MODE_ABS);
+
+  return;
+} /* end refill_arm */
+
+/* FIFO has reached the low water mark, start the next transfer */
+static enum hrtimer_restart refill_timer_fn(struct hrtimer *timer) {
+
+  unsigned long flags;
+  timing_card_data *card;
+
+  card = container_of(timer, timing_card_data, refill_timer);
+
+  spin_lock_irqsave(&card->dma_lock, flags);
+
+  /* how late the timer was for the low water mark */
+  hist_add(card, HIST_SLEEP, ktime_to_ns(ktime_get()) - card->refill.due_ns);
+
+  if ( card->dma_running )
+    dma_refill_kick(card);
+
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  return HRTIMER_NORESTART;
+} /* end refill_timer_fn */
+
+/* program channel 1 for dma_bus_addr/dma_size and go (dma_lock held) */
+static void dma_refill_kick(timing_card_data *card) {
 
   /* clear interrupts and disable DMA */
-  iowrite8(0x08, timing_card[12].base + 0xa9);
-  iowrite8(0x00, timing_card[12].base + 0xa9);
+  iowrite8(0x08, card->port[12].base + 0xa9);
+  iowrite8(0x00, card->port[12].base + 0xa9);
 
   /* Mode - 32 bit bus, don't increment local addr, enable interrupt */
-  iowrite32(cpu_to_le32(0x00020c01),   timing_card[12].base + 0x94); 
+  iowrite32(cpu_to_le32(0x00020c01),   card->port[12].base + 0x94); 
 
   /* PCI and local bus addresses, transfer count, transfer direction */
-  iowrite32(cpu_to_le32(dma_bus_addr), timing_card[12].base + 0x98);
-  iowrite32(cpu_to_le32(0x14),         timing_card[12].base + 0x9c);
-  iowrite32(cpu_to_le32(dma_size),     timing_card[12].base + 0xa0);
-  iowrite32(0x00,                      timing_card[12].base + 0xa4);
+  iowrite32(cpu_to_le32(card->dma_bus_addr), card->port[12].base + 0x98);
+  iowrite32(cpu_to_le32(0x14),         card->port[12].base + 0x9c);
+  iowrite32(cpu_to_le32(card->dma_size),     card->port[12].base + 0xa0);
+  iowrite32(0x00,                      card->port[12].base + 0xa4);
 
   /* Enable DMA */
-  iowrite8( 0x01, timing_card[12].base + 0xa9);
+  iowrite8( 0x01, card->port[12].base + 0xa9);
  
-  /* Start DMA */
-  iowrite8( 0x03, timing_card[12].base + 0xa9);
-  start_ns =  ktime_to_ns(ktime_get());
+  /* Start DMA, record start time */
+  iowrite8( 0x03, card->port[12].base + 0xa9);
+  card->start_ns = ktime_to_ns(ktime_get());
+  refill_mark_start(card, card->start_ns);
+  stats_margin(card);
+
+  /* low water mark (almost empty) to transfer under way */
+  if ( card->refill.due_set ) {
+    hist_add(card, HIST_GAP, card->start_ns - card->refill.due_ns);
+    card->refill.due_set = 0;
+  }
 
- #if DEBUG != 0
-  printk(KERN_DEBUG "dma_transfer() exit success\n");
- #endif 
+  trace_timing_dma_start(card->index, card->dma_size, card->total_size, 0);
 
-  return count;
+  return;
+} /* end dma_refill_kick */
+
+/* function to initiate a DMA transfer */
+static ssize_t dma_transfer(struct file *filp, const char __user *buf,
+          size_t count, loff_t *f_pos) {
+
+  int rc;
+  timing_card_data *card;
+  struct iovec iov;
+  struct iov_iter iter;
+
+  card = ((timing_dev_data *)filp->private_data)->card;
+
+  if ( !count )
+    return 0;
+
+  rc = import_single_range(WRITE, (void __user *)buf, count, &iov, &iter);
+  if ( rc )
+    return rc;
+
+  /* queued behind whatever is playing */
+  rc = dma_submit(card, filp, NULL, &iter, 0, count);
+
+  return rc ? rc : count;
 } /* end DMA transfer function */
 
-/* function to probe settings on DO_CSR for DMA */
-void configure_for_dma(void) {
-      
-  u32 tmp32;
+/* 
+   write_iter for the DO FIFO, so sequences can be queued
+   with AIO or io_uring. An async kiocb is completed by the
+   kthread once the stream has played the sequence (with
+   -ECANCELED if it was dropped by TIMING_IOC_STOP); a sync
+   one returns as soon as it is queued, like write(), or with
+   O_DIRECT once it has been played.
+*/
+static ssize_t timing_write_iter(struct kiocb *iocb, struct iov_iter *from) {
 
-  tmp32 = ioread32(timing_card[1].base);
+  int rc;
+  u8 byte;
+  u32 value;
+  size_t count, width;
+  struct file *filp;
+  timing_dev_data *dev;
+  timing_card_data *card;
 
-  /* output enabled status */
-  if ((tmp32 & 0x128) == 0x100) {
-    output_enabled = 1;
-    if ( dma_waiting) {
-      dma_waiting = 0;
-      wake_up_process(dma_kthread);
+  filp = iocb->ki_filp;
+  dev = filp->private_data;
+  card = dev->card;
+  count = iov_iter_count(from);
+
+  /* a register takes one word (the 8254 one byte), */
+  /* however the caller's buffers split it          */
+  if ( dev != &card->port[5] ) {
+    width = dev->component == TIMER8254_ID ? 1 : 4;
+    if ( count != width )
+      return -EINVAL;
+    if ( width == 1 ) {
+      if ( copy_from_iter(&byte, 1, from) != 1 )
+	return -EFAULT;
+      value = byte;
     }
-    else
-      output_enabled = 0;
+    else if ( copy_from_iter(&value, 4, from) != 4 )
+      return -EFAULT;
+    timing_reg_write(dev, value);
+    return width;
   }
-      
-  /* determine fifo width */
-  if ( tmp32 & 0x01 )
-    fifo_width = 4;
-  else
-    fifo_width = 2; /* NOTE -- could be 1... no way to tell? */
 
-  /* determine clock period */
-  switch ( (tmp32 & 0x06) >> 1 ) {
+  if ( !count )
+    return 0;
 
-  case  0x00 :
-    /* custom clock width */
-    ns_clock_period = 10000;
-    break;
+  rc = dma_submit(card, filp, iocb, from, 0, count);
+  if ( rc )
+    return rc;
 
-  case 0x01 :
-    ns_clock_period = 50;
-    break;
-	
-  case 0x02 :
-    ns_clock_period = 100;
-    break;
+  return is_sync_kiocb(iocb) ? count : -EIOCBQUEUED;
+} /* end timing_write_iter */
 
-  case 0x03 :
-  default   :
-    ns_clock_period = 0; /* lets hope not */
-    break;
+/*
+   Queue a sequence of count bytes: from the user memory in
+   iter (write), or already in the pool at offset (iter NULL,
+   for TIMING_IOC_SUBMIT). Waits for a free queue slot and
+   for pool buffers unless the file or iocb is non-blocking.
+   An iocb is completed when the sequence has been played; a
+   sync O_DIRECT write sleeps until then.
+ */
+static int dma_submit(timing_card_data *card, struct file *filp,
+		      struct kiocb *iocb, struct iov_iter *iter,
+		      size_t offset, size_t count) {
+
+  int rc, nowait, direct, sync;
+  timing_seq *seq;
+  timing_sync wait;
+
+  nowait = (filp->f_flags & O_NONBLOCK) ||
+    (iocb && (iocb->ki_flags & IOCB_NOWAIT));
+  direct = iter && ((filp->f_flags & O_DIRECT) ||
+		    (iocb && (iocb->ki_flags & IOCB_DIRECT)));
+  /* an async write is told when its pages are free again, */
+  /* a sync one sleeps until then                           */
+  sync = direct && (!iocb || is_sync_kiocb(iocb));
+
+  mutex_lock(&card->dma_mutex);
+
+  /* not while the FIFO replays a pattern by itself, nor */
+  /* once remove has stopped the stream for good          */
+  rc = card->gone ? -ENODEV : dma_pattern_busy(card);
+
+  while ( !rc ) {
+
+    seq = dma_seq_get(card);
+    if ( seq ) {
+
+      if ( direct ) {
+	/* O_DIRECT pages are sent as they are, or not at all */
+	rc = -EINVAL;
+	if ( iter_is_iovec(iter) && iter->nr_segs == 1 )
+	  rc = dma_user_pin(card, seq, iov_iter_iovec(iter).iov_base, count);
+	if ( rc == -E2BIG )
+	  rc = -EINVAL;
+	if ( !rc )
+	  iov_iter_advance(iter, count);
+      }
+      else if ( iter )
+	rc = dma_pool_fill(card, seq, iter, count);
+      else
+	rc = dma_pool_segs(card, seq, offset, count);
+
+      /* only a busy pool is worth waiting for */
+      if ( rc != -EBUSY )
+	break;
+
+      /* poll() holds back POLLOUT until this much is free */
+      card->pool_want = DIV_ROUND_UP(count, card->dma_pool_buf_size);
+    }
 
-  } /* end switch */
+    rc = dma_queue_wait(card, nowait);
+    if ( rc )
+      break;
+  }
 
-  dma_configured = 1;
+  if ( !rc ) {
+    seq->bytes = count;
+    if ( iocb && !is_sync_kiocb(iocb) )
+      seq->iocb = iocb;
+    if ( sync ) {
+      init_completion(&wait.done);
+      seq->sync = &wait;
+    }
+    if ( dma_chain )
+      dma_chain_build(card, seq);
+    dma_queue_submit(card, seq);
+  }
 
-  return;
-} /* end configure function */
+  mutex_unlock(&card->dma_mutex);
 
-/* 
-   Called when the device is written to --
+  if ( rc || !sync )
+    return rc;
 
-   Note: There are 3 different components we could write to.
-         This function deals only with writing to the 7300
-	 registers. Writing to the 8254 timer or the 9080 chip
-	 is dealt with in seperate functions.
-*/
-static ssize_t timing_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *f_pos) {
+  /* the buffer is the caller's again once the kthread reaps seq */
+  rc = wait_for_completion_killable(&wait.done);
+  if ( rc ) {
+    /* dying; the pages stay pinned, but wait is going away */
+    mutex_lock(&card->dma_mutex);
+    if ( seq->sync == &wait )
+      seq->sync = NULL;
+    mutex_unlock(&card->dma_mutex);
+    return rc;
+  }
 
-  int rc, curr_count, offset, remaining;
-  timing_dev_data *my_dev;
-  uint32_t bounce_buff;
+  return wait.result;
+} /* end dma_submit */
 
- #if DEBUG != 0
-  printk(KERN_DEBUG "timing_write() entry\n");
- #endif
+/*
+   Queue a run-length sequence (TIMING_IOC_SUBMIT_RLE). Only
+   the runs are kept; the refill engine expands each chunk
+   into rle_buf when it picks it, so the sequence holds no
+   pool buffers however long it is. A chain is walked by the
+   bridge alone, so with dma_chain it is expanded into the
+   pool here instead.
+ */
+static int dma_submit_rle(timing_card_data *card, struct file *filp,
+			  struct timing_rle *rle) {
 
-  my_dev = filp->private_data;
+  int rc;
+  u32 i;
+  u64 words;
+  timing_seq *seq;
+  struct timing_run *runs;
 
-  /* timing chip only takes 1 byte... */
-  if ( my_dev->component == TIMER8254_ID) 
-    return chip_8254_write(filp, buf, count, f_pos);
+  if ( !rle->count )
+    return 0;
+  if ( rle->count > TIMING_RLE_MAX_RUNS )
+    return -E2BIG;
 
-  /* writing to FIFO we want DMA */
-  if ( my_dev == &timing_card[5] )
-    return dma_transfer(filp, buf, count, f_pos);
+  runs = vmemdup_user(u64_to_user_ptr(rle->runs),
+		      rle->count * sizeof(*runs));
+  if ( IS_ERR(runs) )
+    return PTR_ERR(runs);
 
-  /* going to write MAX 32 bytes at a time */
-  remaining = count;
-  offset = 0;
+  for ( i = 0, words = 0; i < rle->count; i++ )
+    words += runs[i].repeat;
 
-  /* while we still need to write */
-  while ( remaining > 0 ) {
-    
-    bounce_buff = 0x0;
+  rc = 0;
+  if ( words > SIZE_MAX / 4 )
+    rc = -EFBIG;
+  if ( !words || rc )
+    goto out;
 
-    /* if we're going to need to write more than 1 */
-    if ( remaining > 4 ) {
-      curr_count = 4;
-      remaining -= 4;
+  mutex_lock(&card->dma_mutex);
+
+  /* not while the FIFO replays a pattern by itself, nor */
+  /* once remove has stopped the stream for good          */
+  rc = card->gone ? -ENODEV : dma_pattern_busy(card);
+
+  while ( !rc ) {
+
+    seq = dma_seq_get(card);
+    if ( seq ) {
+
+      rc = dma_chain ?
+	dma_pool_fill_rle(card, seq, runs, rle->count, words * 4) : 0;
+
+      /* only a busy pool is worth waiting for */
+      if ( rc != -EBUSY )
+	break;
+
+      /* poll() holds back POLLOUT until this much is free */
+      card->pool_want = DIV_ROUND_UP(words * 4, card->dma_pool_buf_size);
     }
+
+    rc = dma_queue_wait(card, filp->f_flags & O_NONBLOCK);
+    if ( rc )
+      break;
+  }
+
+  if ( !rc ) {
+    seq->bytes = words * 4;
+    if ( dma_chain )
+      dma_chain_build(card, seq);
     else {
-      curr_count = remaining;
-      remaining = 0;
-    }
-    
-    /* get data */
-    rc = copy_from_user(&bounce_buff, buf + offset, curr_count);
-    if (rc) {
-      printk(KERN_ALERT "timing_write() bad copy_from_user\n");
-      return -EFAULT;
+      /* the slot owns them now, dma_seq_release frees them */
+      seq->runs = runs;
+      seq->run_count = rle->count;
+      runs = NULL;
     }
+    dma_queue_submit(card, seq);
+  }
 
-    offset += curr_count;
+  mutex_unlock(&card->dma_mutex);
 
-    bounce_buff = cpu_to_le32(bounce_buff);
+ out:
+  kvfree(runs);
 
-   #if DEBUG != 0
-    printk(KERN_DEBUG "timing_write recvd %x\n", bounce_buff);
-   #endif
-    
-    /* write data */
-    iowrite32(bounce_buff, my_dev->base);
+  return rc;
+} /* end dma_submit_rle */
 
-    /* if its the last write to the DO_CSR */
-    if ( !remaining && (my_dev == &timing_card[1]) )
-      configure_for_dma();
-  }
+/* queue slot n (free running count) */
+static timing_seq *dma_seq_at(timing_card_data *card, u32 n) {
 
- #if DEBUG != 0
-  printk(KERN_DEBUG "timing_write() exit success\n");
- #endif 
+  return &card->seq[n % card->queue_len];
+} /* end dma_seq_at */
 
-  return count - remaining;
-} /* end timing_write */
+/* next free queue slot or NULL if full (dma_mutex held) */
+static timing_seq *dma_seq_get(timing_card_data *card) {
 
-/* 
-   Writing to the 7300 registers is done in 32 bit words while 
-       writing to the 8254 chip is done in 8 bits. 
+  timing_seq *seq;
+
+  if ( card->q_tail - card->q_reap >= card->queue_len )
+    return NULL;
+
+  seq = dma_seq_at(card, card->q_tail);
+  seq->seg_count = 0;
+  seq->cycles = card->cycles;
+  seq->cycles_done = 0;
+  seq->iocb = NULL;
+  seq->sync = NULL;
+  seq->result = 0;
+
+  return seq;
+} /* end dma_seq_get */
+
+/*
+   Could a sequence that needs need pool buffers be queued now
+   without waiting? A free slot and that many idle buffers;
+   what poll() reports as POLLOUT. (dma_mutex held)
  */
-static ssize_t chip_8254_write(struct file *filp, const char __user *buf,
-			       size_t count, loff_t *f_pos) {
+static int dma_can_accept(timing_card_data *card, int need) {
+
+  if ( card->q_tail - card->q_reap >= card->queue_len )
+    return 0;
+
+  return dma_pool_idle(card) >= need;
+} /* end dma_can_accept */
+
+/*
+   The last sequence queued if it loops until something is
+   queued behind it, else NULL (dma_mutex held). What it
+   holds is not freed by waiting.
+ */
+static timing_seq *dma_loop_tail(timing_card_data *card) {
+
+  timing_seq *seq;
+
+  if ( card->q_tail == card->q_reap )
+    return NULL;
+
+  seq = dma_seq_at(card, card->q_tail - 1);
+
+  return seq->cycles ? NULL : seq;
+} /* end dma_loop_tail */
+
+/*
+   Sleep until the kthread frees something (dma_mutex held,
+   dropped while asleep). Non-blocking callers get -EAGAIN
+   and should poll() for POLLOUT.
+ */
+static int dma_queue_wait(timing_card_data *card, int nowait) {
+
   int rc;
-  timing_dev_data *dev;
-  unsigned char msg;
+  u32 reaped;
 
- #if DEBUG != 0
-  printk(KERN_DEBUG "8254_write() entry\n");
- #endif
+  if ( nowait )
+    return -EAGAIN;
 
-  /* retrieve device data */
-  dev = filp->private_data;
+  /* nothing queued, nothing will be freed */
+  reaped = card->q_reap;
+  if ( card->q_tail == reaped )
+    return -ENOSPC;
 
-  /* 8254 commands and data are just 1 byte */
-  if ( count != 1 ) {
-    printk(KERN_WARNING "8254 registers are just 8 bits wide\n");
-    return -EINVAL;
-  }
+  /* the one slot is a loop waiting for us to be queued */
+  if ( card->queue_len == 1 && dma_loop_tail(card) )
+    return -ENOSPC;
 
-  /* do actual data retrieval */
-  rc = copy_from_user(&msg, buf, count);
-  if ( rc < 0 ) {
-    printk(KERN_ALERT "8254_write bad copy from user\n");
-    return -EFAULT;
+  mutex_unlock(&card->dma_mutex);
+  rc = wait_event_interruptible(card->queue_wait,
+				READ_ONCE(card->q_reap) != reaped ||
+				READ_ONCE(card->gone));
+  mutex_lock(&card->dma_mutex);
+
+  /* the card was removed meanwhile */
+  if ( !rc && card->gone )
+    rc = -ENODEV;
+
+  return rc;
+} /* end dma_queue_wait */
+
+/*
+   Make a loaded slot visible to the stream. An idle stream
+   starts on it; a running one gets to it when everything
+   ahead of it has played. (dma_mutex held)
+ */
+static void dma_queue_submit(timing_card_data *card, timing_seq *seq) {
+
+  unsigned long flags;
+
+  spin_lock_irqsave(&card->dma_lock, flags);
+
+  seq->num = card->q_tail++;
+  trace_timing_submit(card->index, seq->num, seq->bytes, seq->cycles);
+
+  if ( !card->dma_running ) {
+
+    /* everything before it has been played */
+    card->dma_running = 1;
+    dma_seq_cursor(card, seq);
+
+    if ( dma_chain )
+      dma_chain_start(card, seq);
+    else
+      dma_refill_start(card);
   }
+  else if ( dma_chain )
+    dma_chain_splice(card, dma_seq_at(card, seq->num - 1));
 
-  /* preform IO */
-  iowrite8(msg, dev->base);
+  spin_unlock_irqrestore(&card->dma_lock, flags);
 
- #if DEBUG != 0
-  printk(KERN_DEBUG "8254_write() exit success\n");
- #endif
+  return;
+} /* end dma_queue_submit */
 
-  return count;
-} /* end 8284_chip_write function */
+/*
+   The stream is done with the sequence at the head of the
+   queue; the kthread gives back its memory. Returns the new
+   head or NULL if nothing else is queued. (dma_lock held)
+ */
+static timing_seq *dma_seq_retire(timing_card_data *card) {
 
-long timing_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  card->q_head++;
+  if ( !card->wake_ns )
+    card->wake_ns = ktime_to_ns(ktime_get());
+  wake_up_process(card->dma_kthread);
 
-  timing_dev_data *dev;
+  if ( card->q_head == card->q_tail )
+    return NULL;
 
-  /* retrieve device info */
-  dev = filp->private_data;
+  return dma_seq_at(card, card->q_head);
+} /* end dma_seq_retire */
 
-  switch(cmd) {
+/* release the retired slots (dma_mutex held) */
+static void dma_queue_reap(timing_card_data *card) {
 
-  case CHANGE_PLX_OFFSET:
-    
-    /* make sure this is the correct device */
-    if ( dev->component != PLX9080_ID ) {
-      printk(KERN_ALERT "TIMING_IOCTL CHANGE_PLX_OFFSET device NOT PLX\n");
-      return -ENOTTY;
-    }
+  u32 head;
+  timing_seq *seq;
+  unsigned long flags;
 
-    /* offset must be positive and less than 0x100 (see plx 9080 datasheet */
-    if ( arg < 0 || arg > 0x100 ) { 
-      printk(KERN_ALERT "TIMING_IOCTL CHANGE_PLX_OFFSET bad argument\n");
-      return -ENOTTY;
+  spin_lock_irqsave(&card->dma_lock, flags);
+  head = card->q_head;
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  if ( card->q_reap == head )
+    return;
+
+  while ( card->q_reap != head ) {
+
+    seq = dma_seq_at(card, card->q_reap);
+    dma_seq_release(card, seq);
+
+    /* pages are given back, the writer can have its buffer */
+    if ( seq->iocb )
+      seq->iocb->ki_complete(seq->iocb,
+			     seq->result ? seq->result : seq->bytes, 0);
+    seq->iocb = NULL;
+
+    if ( seq->sync ) {
+      seq->sync->result = seq->result;
+      complete(&seq->sync->done);
     }
-    
-    dev->offset = arg;
+    seq->sync = NULL;
 
-   #if DEBUG != 0
-    printk(KERN_DEBUG "new plx9080 offset is -- %x", dev->offset);
-   #endif
-    
-    return 0; /* success */
-  /* END CASE CHANGE_PLX_OFFSET */
+    card->q_reap++;
+  }
 
-  default:
-    printk(KERN_DEBUG "TIMING_IOCTL bad command\n");
-    return -ENOTTY;
+  wake_up_interruptible(&card->queue_wait);
 
-  } /* end command switch statement */
+  return;
+} /* end dma_queue_reap */
 
-  /* never reached */
-  return -EINVAL;
-} /* end of ioctl command */
+/* point the refill engine at the top of seq (dma_lock held) */
+static void dma_seq_cursor(timing_card_data *card, timing_seq *seq) {
+
+  card->total_size  = seq->bytes;
+  card->dma_seg_idx = 0;
+  card->dma_seg_off = 0;
+  seq->cycles_done  = 0;
+
+  return;
+} /* end dma_seq_cursor */
+
+/* stop channel 1 and drop everything queued (dma_mutex held) */
+static void dma_stop_stream(timing_card_data *card) {
+
+  u32 n;
+  timing_seq *seq;
+  unsigned long flags;
+
+  /* IRQ and timer must not start anything from here on */
+  spin_lock_irqsave(&card->dma_lock, flags);
+  card->dma_running = 0;
+  card->dma_waiting = 0;
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  hrtimer_cancel(&card->refill_timer);
+  hrtimer_cancel(&card->start_timer);
+
+  dma_abort(card);
+
+  /* nothing queued will be played now; a loop was */
+  /* meant to run until stopped, so it still counts  */
+  spin_lock_irqsave(&card->dma_lock, flags);
+  for ( n = card->q_head; n != card->q_tail; n++ ) {
+    seq = dma_seq_at(card, n);
+    if ( n != card->q_head || seq->cycles )
+      seq->result = -ECANCELED;
+  }
+  card->q_head = card->q_tail;
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  dma_queue_reap(card);
+
+  return;
+} /* end dma_stop_stream */
+
+/* first transfer of the refill scheme, hrtimer does the rest */
+static void dma_refill_start(timing_card_data *card) {
+
+  u32 tmp32;
+
+  /* initialize first DMA transfer */
+  card->dma_size = dma_next_chunk(card, FIFO_SIZE * card->fifo_width);
+
+  /* FIFO was cleared with the DO_CSR setup (or ran dry) */
+  card->refill.level_words = 0;
+  card->refill.level_ns = 0;
+
+  /* enable interrupts from DMA done activity */
+  tmp32 = ioread32(card->port[12].base + PLX9080_INTCSR);
+  iowrite32( tmp32 | ( 0x1 << 8 ) | ( 0x1 << 19 ),
+	     card->port[12].base + PLX9080_INTCSR);
+
+  dma_refill_kick(card);
+
+  return;
+} /* end dma_refill_start */
+
+/* allocate the persistent DMA pool and queue, called from probe */
+static int dma_pool_alloc(timing_card_data *card) {
+
+  int i;
+  struct pci_dev *dev = card->pdev;
+  timing_seq *seq;
+
+  /* buffers are whole pages and fit one chain descriptor */
+  card->dma_pool_buf_size = PAGE_ALIGN(pool_buf_kb * 1024);
+  if ( !pool_bufs || !card->dma_pool_buf_size ||
+       card->dma_pool_buf_size > DMA_CHAIN_MAX_SIZE ) {
+    printk(KERN_ALERT "timing: bad pool geometry %d x %d KB\n",
+	   pool_bufs, pool_buf_kb);
+    return -EINVAL;
+  }
+
+  /* room for a full pool or a scattered user buffer */
+  card->dma_seg_max = max(pool_bufs, max_segs);
+  card->queue_len = rounddown_pow_of_two(clamp(queue_depth, 1,
+						 TIMING_QUEUE_MAX));
+
+  card->dma_pool = kcalloc(pool_bufs, sizeof(timing_dma_seg), GFP_KERNEL);
+  card->dma_pool_users = kcalloc(pool_bufs, sizeof(int), GFP_KERNEL);
+  if ( !card->dma_pool || !card->dma_pool_users )
+    goto no_mem;
+
+  for ( i = 0; i < pool_bufs; i++ ) {
+    card->dma_pool[i].virt = pci_alloc_consistent(dev,
+						  card->dma_pool_buf_size,
+						  &card->dma_pool[i].bus);
+    if ( !card->dma_pool[i].virt )
+      goto no_mem;
+    card->dma_pool[i].len = card->dma_pool_buf_size;
+    card->dma_pool_count++;
+  }
+
+  /* runs are expanded here, one refill (a FIFO at most) at a time */
+  card->rle_buf.len = FIFO_SIZE * 4;
+  card->rle_buf.virt = pci_alloc_consistent(dev, card->rle_buf.len,
+					    &card->rle_buf.bus);
+  if ( !card->rle_buf.virt )
+    goto no_mem;
+
+  /* every queue slot can hold a full sequence */
+  for ( i = 0; i < card->queue_len; i++ ) {
+
+    seq = &card->seq[i];
+
+    seq->segs = kcalloc(card->dma_seg_max, sizeof(timing_dma_seg),
+			GFP_KERNEL);
+    seq->bufs = bitmap_zalloc(pool_bufs, GFP_KERNEL);
+    if ( !seq->segs || !seq->bufs )
+      goto no_mem;
+
+    /* two chain descriptors per segment, see dma_chain_build */
+    seq->desc = pci_alloc_consistent(dev, 2 * card->dma_seg_max *
+				     sizeof(plx9080_dma_desc),
+				     &seq->desc_bus);
+    if ( !seq->desc )
+      goto no_mem;
+  }
+
+  printk(KERN_WARNING "timing: DMA pool of %d x %u bytes, %d queue slots\n",
+	 card->dma_pool_count, (unsigned)card->dma_pool_buf_size,
+	 card->queue_len);
+
+  return 0;
+
+ no_mem:
+  printk(KERN_ALERT "timing: failed to allocate DMA pool\n");
+  dma_pool_free(card);
+  return -ENOMEM;
+} /* end dma_pool_alloc */
+
+/* release the persistent DMA pool and queue */
+static void dma_pool_free(timing_card_data *card) {
+
+  int i;
+  struct pci_dev *dev = card->pdev;
+  timing_seq *seq;
+
+  for ( i = 0; i < card->queue_len; i++ ) {
+
+    seq = &card->seq[i];
+
+    if ( seq->desc )
+      pci_free_consistent(dev, 2 * card->dma_seg_max *
+			  sizeof(plx9080_dma_desc),
+			  seq->desc, seq->desc_bus);
+    kfree(seq->segs);
+    bitmap_free(seq->bufs);
+
+    seq->desc = NULL;
+    seq->segs = NULL;
+    seq->bufs = NULL;
+  }
+
+  if ( card->rle_buf.virt )
+    pci_free_consistent(dev, card->rle_buf.len,
+			card->rle_buf.virt, card->rle_buf.bus);
+  card->rle_buf.virt = NULL;
+
+  while ( card->dma_pool_count > 0 ) {
+    card->dma_pool_count--;
+    pci_free_consistent(dev, card->dma_pool_buf_size,
+			card->dma_pool[card->dma_pool_count].virt,
+			card->dma_pool[card->dma_pool_count].bus);
+  }
+
+  kfree(card->dma_pool);
+  kfree(card->dma_pool_users);
+  card->dma_pool = NULL;
+  card->dma_pool_users = NULL;
+
+  return;
+} /* end dma_pool_free */
+
+/*
+   Copy a user sequence into free pool buffers and describe
+   it as segments of seq. -EBUSY if the buffers it needs are
+   still held by queued sequences, -EPERM if the pool is
+   mapped and its free buffers may hold staged data.
+ */
+static int dma_pool_fill(timing_card_data *card, timing_seq *seq,
+			 struct iov_iter *iter, size_t count) {
+
+  int i, rc;
+  size_t offset, block;
+
+  if ( atomic_read(&card->pool_maps) )
+    return -EPERM;
+
+  rc = dma_pool_room(card, count);
+  if ( rc )
+    return rc;
+
+  for ( i = 0, offset = 0; offset < count; i++ ) {
+
+    if ( card->dma_pool_users[i] )
+      continue;
+
+    block = MIN(count - offset, card->dma_pool_buf_size);
+
+    if ( copy_from_iter(card->dma_pool[i].virt, block, iter) != block ) {
+      printk(KERN_ALERT "timing_write() bad copy_from_user\n");
+      dma_seq_release(card, seq);
+      return -EFAULT;
+    }
+
+    dma_pool_hold(card, seq, i);
+    dma_seg_add(card, seq, card->dma_pool[i].virt,
+		card->dma_pool[i].bus, block);
+
+    offset += block;
+  }
+
+  return 0;
+} /* end dma_pool_fill */
+
+/*
+   -EFBIG if count bytes can never fit in the pool, -EBUSY if
+   not enough buffers are free of queued sequences right now,
+   -ENOSPC if they won't be before a loop at the tail of the
+   queue ends, which it does only once this is queued.
+ */
+static int dma_pool_room(timing_card_data *card, size_t count) {
+
+  int need;
+  timing_seq *loop;
+
+  if ( count > card->dma_pool_count * card->dma_pool_buf_size ) {
+    printk(KERN_ALERT "timing: %u byte sequence exceeds DMA pool\n",
+	   (unsigned)count);
+    return -EFBIG;
+  }
+
+  need = DIV_ROUND_UP(count, card->dma_pool_buf_size);
+  if ( dma_pool_idle(card) >= need ) {
+    /* whoever poll() was waiting for room for is served */
+    card->pool_want = 0;
+    return 0;
+  }
+
+  /* waiting frees everything but what the loop holds */
+  loop = dma_loop_tail(card);
+  if ( loop && card->dma_pool_count -
+       (int)bitmap_weight(loop->bufs, card->dma_pool_count) < need )
+    return -ENOSPC;
+
+  return -EBUSY;
+} /* end dma_pool_room */
+
+/* pool buffers no queued sequence holds (dma_mutex held) */
+static int dma_pool_idle(timing_card_data *card) {
+
+  int i, idle;
+
+  for ( i = 0, idle = 0; i < card->dma_pool_count; i++ )
+    if ( !card->dma_pool_users[i] )
+      idle++;
+
+  return idle;
+} /* end dma_pool_idle */
+
+/* dma_pool_fill for runs, expanding count bytes of them */
+static int dma_pool_fill_rle(timing_card_data *card, timing_seq *seq,
+			     struct timing_run *runs, u32 run_count,
+			     size_t count) {
+
+  int i, rc, idx;
+  size_t offset, block, off;
+
+  /* see dma_pool_fill */
+  if ( atomic_read(&card->pool_maps) )
+    return -EPERM;
+
+  rc = dma_pool_room(card, count);
+  if ( rc )
+    return rc;
+
+  idx = 0;
+  off = 0;
+
+  for ( i = 0, offset = 0; offset < count; i++ ) {
+
+    if ( card->dma_pool_users[i] )
+      continue;
+
+    block = MIN(count - offset, card->dma_pool_buf_size);
+
+    rle_expand(runs, run_count, &idx, &off, card->dma_pool[i].virt,
+	       block / 4);
+
+    dma_pool_hold(card, seq, i);
+    dma_seg_add(card, seq, card->dma_pool[i].virt,
+		card->dma_pool[i].bus, block);
+
+    offset += block;
+  }
+
+  return 0;
+} /* end dma_pool_fill_rle */
+
+/*
+   Write up to words words of runs to dst, starting *off words
+   into run *idx, and move that position on. Returns the words
+   written, fewer only at the end of the runs.
+ */
+static size_t rle_expand(const struct timing_run *runs, u32 count,
+			 int *idx, size_t *off, u32 *dst, size_t words) {
+
+  size_t n, done;
+
+  for ( done = 0; done < words && (u32)*idx < count; done += n ) {
+
+    n = MIN(runs[*idx].repeat - *off, words - done);
+    memset32(dst + done, runs[*idx].word, n);
+
+    *off += n;
+    if ( *off == runs[*idx].repeat ) {
+      (*idx)++;
+      *off = 0;
+    }
+  }
+
+  return done;
+} /* end rle_expand */
+
+/* describe count bytes at offset into the pool as segments of seq */
+static int dma_pool_segs(timing_card_data *card, timing_seq *seq,
+			 size_t offset, size_t count) {
+
+  int i;
+  size_t block, in_buf;
+
+  if ( offset > card->dma_pool_count * card->dma_pool_buf_size ||
+       count  > card->dma_pool_count * card->dma_pool_buf_size - offset )
+    return -EFBIG;
+
+  while ( count > 0 ) {
+
+    i      = offset / card->dma_pool_buf_size;
+    in_buf = offset % card->dma_pool_buf_size;
+    block  = MIN(count, card->dma_pool_buf_size - in_buf);
+
+    /* never fails, there is a segment per pool buffer */
+    dma_pool_hold(card, seq, i);
+    dma_seg_add(card, seq, card->dma_pool[i].virt + in_buf,
+		card->dma_pool[i].bus + in_buf, block);
+
+    offset += block;
+    count  -= block;
+  }
+
+  return 0;
+} /* end dma_pool_segs */
+
+/* seq reads pool buffer i, writes must not reuse it meanwhile */
+static void dma_pool_hold(timing_card_data *card, timing_seq *seq, int i) {
+
+  if ( !test_and_set_bit(i, seq->bufs) )
+    card->dma_pool_users[i]++;
+
+  return;
+} /* end dma_pool_hold */
+
+/* give back what seq holds, slot can be reused (dma_mutex held) */
+static void dma_seq_release(timing_card_data *card, timing_seq *seq) {
+
+  int i;
+
+  dma_user_unpin(card, seq);
+
+  for_each_set_bit(i, seq->bufs, card->dma_pool_count)
+    card->dma_pool_users[i]--;
+  bitmap_zero(seq->bufs, card->dma_pool_count);
+
+  kvfree(seq->runs);
+  seq->runs = NULL;
+  seq->run_count = 0;
+
+  if ( seq->wave )
+    seq->wave->users--;
+  seq->wave = NULL;
+
+  seq->seg_count = 0;
+
+  return;
+} /* end dma_seq_release */
+
+/*
+   A mapping of card memory (pool or DI ring) holds the card,
+   so the memory outlives timing_dev_remove until it is
+   unmapped.
+ */
+static void timing_vm_open(struct vm_area_struct *vma) {
+
+  timing_card_data *card = vma->vm_private_data;
+
+  kobject_get(&card->kobj);
+
+  return;
+} /* end timing_vm_open */
+
+static void timing_vm_close(struct vm_area_struct *vma) {
+
+  timing_card_data *card = vma->vm_private_data;
+
+  kobject_put(&card->kobj);
+
+  return;
+} /* end timing_vm_close */
+
+static const struct vm_operations_struct timing_vm_ops = {
+  .open  = timing_vm_open,
+  .close = timing_vm_close,
+};
+
+/*
+   A mapping of the pool is counted for as long as it lives
+   (forks and splits included). Buffers staged through it are
+   not held by any sequence until they are submitted, so
+   write() can't tell them apart from free ones and is
+   refused while the count is non-zero. The count isn't kept
+   under dma_mutex: a writer faulting on its buffer takes
+   mmap_lock with dma_mutex held, and these run under it.
+ */
+static void dma_pool_vm_open(struct vm_area_struct *vma) {
+
+  timing_card_data *card = vma->vm_private_data;
+
+  atomic_inc(&card->pool_maps);
+  timing_vm_open(vma);
+
+  return;
+} /* end dma_pool_vm_open */
+
+static void dma_pool_vm_close(struct vm_area_struct *vma) {
+
+  timing_card_data *card = vma->vm_private_data;
+
+  atomic_dec(&card->pool_maps);
+  timing_vm_close(vma);
+
+  return;
+} /* end dma_pool_vm_close */
+
+static const struct vm_operations_struct dma_pool_vm_ops = {
+  .open  = dma_pool_vm_open,
+  .close = dma_pool_vm_close,
+};
+
+/* 
+   mmap of the DO FIFO device hands out the DMA pool, so a
+   sequence generator can write straight into the buffers
+   the PLX9080 reads from. The pool is mapped end to end;
+   vm_pgoff is a page offset into it.
+ */
+static int dma_pool_mmap(timing_card_data *card, struct vm_area_struct *vma) {
+
+  int rc;
+
+  rc = dma_segs_mmap(card, card->dma_pool, card->dma_pool_count,
+		     card->dma_pool_buf_size, vma);
+  if ( rc )
+    return rc;
+
+  vma->vm_ops = &dma_pool_vm_ops;
+  vma->vm_private_data = card;
+  dma_pool_vm_open(vma);
+
+  return 0;
+} /* end dma_pool_mmap */
+
+/*
+   Map count buffers of size bytes each end to end into vma.
+   Only shared mappings: a private one would copy on write
+   away from the buffers the PLX9080 reads.
+ */
+static int dma_segs_mmap(timing_card_data *card, timing_dma_seg *segs,
+			 int count, size_t size, struct vm_area_struct *vma) {
+
+  int i, rc;
+  size_t len, done, block, offset, in_buf;
+
+  len    = vma->vm_end - vma->vm_start;
+  offset = vma->vm_pgoff << PAGE_SHIFT;
+
+  if ( !(vma->vm_flags & VM_SHARED) )
+    return -EINVAL;
+
+  if ( offset > count * size || len > count * size - offset )
+    return -EINVAL;
+
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+  for ( rc = 0, done = 0; done < len && !rc; done += block ) {
+
+    i      = (offset + done) / size;
+    in_buf = (offset + done) % size;
+    block  = MIN(len - done, size - in_buf);
+
+    rc = dma_seg_remap(card, &segs[i], size, in_buf, block,
+		       vma, vma->vm_start + done);
+  }
+
+  return rc;
+} /* end dma_segs_mmap */
+
+/*
+   Map block bytes from in_buf on of coherent buffer seg (size
+   bytes) at addr in vma. The pages come from dma_get_sgtable
+   rather than virt_to_phys, which is wrong for remapped or
+   IOMMU backed allocations, and are inserted without touching
+   the bounds of the vma.
+ */
+static int dma_seg_remap(timing_card_data *card, timing_dma_seg *seg,
+			 size_t size, size_t in_buf, size_t block,
+			 struct vm_area_struct *vma, unsigned long addr) {
+
+  int i, rc;
+  size_t len;
+  struct sg_table sgt;
+  struct scatterlist *sg;
+
+  rc = dma_get_sgtable(&card->pdev->dev, &sgt, seg->virt, seg->bus, size);
+  if ( rc )
+    return rc;
+
+  for_each_sg(sgt.sgl, sg, sgt.orig_nents, i) {
+
+    if ( !block )
+      break;
+
+    /* whole pages, the buffers are page aligned */
+    if ( in_buf >= sg->length ) {
+      in_buf -= sg->length;
+      continue;
+    }
+
+    len = MIN(block, sg->length - in_buf);
+    rc = remap_pfn_range(vma, addr,
+			 page_to_pfn(sg_page(sg)) + (in_buf >> PAGE_SHIFT),
+			 len, vma->vm_page_prot);
+    if ( rc )
+      break;
+
+    addr   += len;
+    block  -= len;
+    in_buf  = 0;
+  }
+
+  sg_free_table(&sgt);
+
+  return rc;
+} /* end dma_seg_remap */
+
+/* append a block to seq, split so each fits a descriptor */
+static int dma_seg_add(timing_card_data *card, timing_seq *seq,
+		       void *virt, dma_addr_t bus, size_t len) {
+
+  size_t block;
+
+  while ( len > 0 ) {
+
+    if ( seq->seg_count >= card->dma_seg_max )
+      return -E2BIG;
+
+    block = MIN(len, (size_t)DMA_CHAIN_MAX_SIZE);
+
+    seq->segs[seq->seg_count].virt = virt;
+    seq->segs[seq->seg_count].bus  = bus;
+    seq->segs[seq->seg_count].len  = block;
+    seq->seg_count++;
+
+    if ( virt )
+      virt += block;
+    bus += block;
+    len -= block;
+  }
+
+  return 0;
+} /* end dma_seg_add */
+
+/*
+   Zero-copy alternative to dma_pool_fill, for O_DIRECT. The
+   caller's pages are pinned and mapped, and the resulting
+   scatterlist becomes the segment list of seq. The pages stay
+   pinned until the stream is done with seq (or is stopped);
+   only then is the kiocb completed or the sync writer woken.
+
+   -EINVAL and -E2BIG mean the buffer can't be sent directly
+   (misaligned or too scattered).
+ */
+static int dma_user_pin(timing_card_data *card, timing_seq *seq,
+			const char __user *buf, size_t count) {
+
+  int i, rc, nents;
+  unsigned long start;
+  struct scatterlist *sg;
+
+  start = (unsigned long)buf;
+
+  /* PLX moves Lwords */
+  if ( !count || !IS_ALIGNED(start, 4) || !IS_ALIGNED(count, 4) )
+    return -EINVAL;
+
+  seq->page_count = DIV_ROUND_UP(offset_in_page(start) + count, PAGE_SIZE);
+  seq->pages = kvmalloc_array(seq->page_count, sizeof(struct page *),
+			      GFP_KERNEL);
+  if ( !seq->pages ) {
+    seq->page_count = 0;
+    return -ENOMEM;
+  }
+
+  /* device only reads, so no FOLL_WRITE; held while it plays */
+  rc = pin_user_pages_fast(start & PAGE_MASK, seq->page_count,
+			   FOLL_LONGTERM, seq->pages);
+  if ( rc != seq->page_count ) {
+    /* give back whatever was pinned */
+    seq->page_count = rc < 0 ? 0 : rc;
+    dma_user_unpin(card, seq);
+    return -EFAULT;
+  }
+
+  rc = sg_alloc_table_from_pages(&seq->sgt, seq->pages,
+				 seq->page_count, offset_in_page(start),
+				 count, GFP_KERNEL);
+  if ( rc ) {
+    dma_user_unpin(card, seq);
+    return rc;
+  }
+
+  nents = pci_map_sg(card->pdev, seq->sgt.sgl, seq->sgt.orig_nents,
+		     PCI_DMA_TODEVICE);
+  if ( !nents ) {
+    sg_free_table(&seq->sgt);
+    dma_user_unpin(card, seq);
+    return -ENOMEM;
+  }
+  seq->sg_mapped = 1;
+
+  seq->seg_count = 0;
+  for_each_sg(seq->sgt.sgl, sg, nents, i) {
+    rc = dma_seg_add(card, seq, NULL, sg_dma_address(sg), sg_dma_len(sg));
+    if ( rc ) {
+      dma_user_unpin(card, seq);
+      return rc;
+    }
+  }
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "dma_user_pin() %d pages in %d segments\n",
+	 seq->page_count, seq->seg_count);
+ #endif
+
+  return 0;
+} /* end dma_user_pin */
+
+/* release pages pinned by dma_user_pin, if any */
+static void dma_user_unpin(timing_card_data *card, timing_seq *seq) {
+
+  if ( seq->sg_mapped ) {
+    pci_unmap_sg(card->pdev, seq->sgt.sgl, seq->sgt.orig_nents,
+		 PCI_DMA_TODEVICE);
+    sg_free_table(&seq->sgt);
+    seq->sg_mapped = 0;
+    seq->seg_count = 0;
+  }
+
+  if ( seq->page_count )
+    unpin_user_pages(seq->pages, seq->page_count);
+
+  kvfree(seq->pages);
+  seq->pages = NULL;
+  seq->page_count = 0;
+
+  return;
+} /* end dma_user_unpin */
+
+/*
+   Next refill of at most max bytes from the sequence at the
+   head of the queue. Chunks never cross a segment, so
+   dma_bus_addr is always one contiguous run. Runs are
+   expanded into rle_buf; this is only called once channel 1
+   is done with the last chunk, so it is free.
+ */
+static size_t dma_next_chunk(timing_card_data *card, size_t max) {
+
+  size_t size;
+  timing_seq *seq;
+
+  seq = dma_seq_at(card, card->q_head);
+
+  if ( seq->runs ) {
+    card->dma_bus_addr = card->rle_buf.bus;
+    return 4 * rle_expand(seq->runs, seq->run_count, &card->dma_seg_idx,
+			  &card->dma_seg_off, card->rle_buf.virt,
+			  MIN(max, card->rle_buf.len) / 4);
+  }
+
+  if ( card->dma_seg_idx >= seq->seg_count )
+    return 0;
+
+  size = MIN(seq->segs[card->dma_seg_idx].len - card->dma_seg_off, max);
+  card->dma_bus_addr = seq->segs[card->dma_seg_idx].bus + card->dma_seg_off;
+
+  card->dma_seg_off += size;
+  if ( card->dma_seg_off == seq->segs[card->dma_seg_idx].len ) {
+    card->dma_seg_idx++;
+    card->dma_seg_off = 0;
+  }
+
+  return size;
+} /* end dma_next_chunk */
+
+/* stop channel 1 so the pool can be rewritten */
+static void dma_abort(timing_card_data *card) {
+
+  int i;
+
+  /* abort the channel if a transfer is still running */
+  if ( !(ioread8(card->port[12].base + PLX9080_DMACSR1) & 
+	 PLX9080_DMACSR_DONE) ) {
+    iowrite8(0x00, card->port[12].base + PLX9080_DMACSR1);
+    iowrite8(PLX9080_DMACSR_ABORT, card->port[12].base + PLX9080_DMACSR1);
+    for ( i = 0; i < 1000; i++ ) {
+      if ( ioread8(card->port[12].base + PLX9080_DMACSR1) & 
+	   PLX9080_DMACSR_DONE )
+	break;
+      udelay(1);
+    }
+  }
+
+  /* don't let the aborted transfer look like a completion */
+  iowrite8(PLX9080_DMACSR_CLEAR_INT, card->port[12].base + PLX9080_DMACSR1);
+
+  return;
+} /* end dma_abort */
+
+/*
+   Describe seq to the PLX9080 as a list of descriptors, one
+   per segment, so the bridge walks them without the CPU.
+   Called before seq is queued.
+
+   A sequence played more than once gets two copies of the
+   list, each linked to the start of the other, with an
+   interrupt at the end of each copy (dma_chain_cycle). The
+   copy that just finished is not fetched again until the
+   other one has played, so that is when the last cycle is
+   marked as the end of the chain, or linked to the next
+   sequence queued (dma_chain_set_end).
+*/
+static void dma_chain_build(timing_card_data *card, timing_seq *seq) {
+
+  int i, r, n;
+  plx9080_dma_desc *desc;
+
+  n = seq->seg_count;
+  seq->rings = seq->cycles == 1 ? 1 : 2;
+  seq->end_link[0] = 0;
+  seq->end_link[1] = 0;
+
+  /* one descriptor per segment, PCI to local */
+  for ( r = 0; r < seq->rings; r++ ) {
+    for ( i = 0; i < n; i++ ) {
+
+      desc = &seq->desc[r * n + i];
+
+      desc->pci_addr   = cpu_to_le32(seq->segs[i].bus);
+      desc->local_addr = cpu_to_le32(DO_FIFO_LADR);
+      desc->size       = cpu_to_le32(seq->segs[i].len);
+
+      /* last one ends the chain or starts the other copy */
+      if ( i + 1 < n )
+	desc->next = cpu_to_le32(dma_chain_desc_bus(seq, r * n + i + 1) |
+				 PLX9080_DMADPR_PCI_SPACE);
+      else if ( seq->rings == 1 || (r == 1 && seq->cycles == 2) )
+	desc->next = cpu_to_le32(PLX9080_DMADPR_PCI_SPACE |
+				 PLX9080_DMADPR_END_CHAIN);
+      else
+	desc->next = cpu_to_le32(dma_chain_desc_bus(seq, (1 - r) * n) |
+				 PLX9080_DMADPR_PCI_SPACE |
+				 PLX9080_DMADPR_TC_INT);
+    }
+  }
+
+  /* descriptors must be visible before the bridge fetches them */
+  wmb();
+
+  return;
+} /* end dma_chain_build */
+
+/*
+   Chained version of dma_refill_start: hand the bridge the
+   descriptors of seq. Demand mode lets the card's DREQ pace
+   the transfer to the FIFO, so there is no refill timing to
+   get right, just an interrupt per cycle. (dma_lock held)
+*/
+static void dma_chain_start(timing_card_data *card, timing_seq *seq) {
+
+  u32 tmp32;
+
+  card->dma_size = seq->bytes;
+
+  /* enable interrupts from DMA done activity */
+  tmp32 = ioread32(card->port[12].base + PLX9080_INTCSR);
+  iowrite32( tmp32 | ( 0x1 << 8 ) | ( 0x1 << 19 ),
+	     card->port[12].base + PLX9080_INTCSR);
+
+  /* clear interrupts and disable DMA */
+  iowrite8(PLX9080_DMACSR_CLEAR_INT, card->port[12].base + PLX9080_DMACSR1);
+  iowrite8(0x00,                     card->port[12].base + PLX9080_DMACSR1);
+
+  /* same mode as single transfers plus chaining and demand mode */
+  iowrite32(cpu_to_le32(0x00020c01 | PLX9080_DMAMODE_CHAIN |
+			PLX9080_DMAMODE_DEMAND),
+	    card->port[12].base + PLX9080_DMAMODE1);
+
+  /* first descriptor lives in PCI space */
+  iowrite32(cpu_to_le32(seq->desc_bus | PLX9080_DMADPR_PCI_SPACE),
+	    card->port[12].base + PLX9080_DMADPR1);
+
+  /* Enable and start DMA */
+  iowrite8(PLX9080_DMACSR_ENABLE, card->port[12].base + PLX9080_DMACSR1);
+  iowrite8(PLX9080_DMACSR_ENABLE | PLX9080_DMACSR_START,
+	   card->port[12].base + PLX9080_DMACSR1);
+  card->start_ns = ktime_to_ns(ktime_get());
+
+  trace_timing_dma_start(card->index, seq->bytes, 0, 1);
+
+  return;
+} /* end dma_chain_start */
+
+/* bus address of chain descriptor idx of seq */
+static dma_addr_t dma_chain_desc_bus(timing_seq *seq, int idx) {
+
+  return seq->desc_bus + idx * sizeof(plx9080_dma_desc);
+} /* end dma_chain_desc_bus */
+
+/*
+   End copy ring of seq in the sequence queued after it, if
+   there is one, else end the chain there. Only for a copy
+   the bridge is not in, or one whose old end is as good as
+   the new one (see dma_chain_splice). (dma_lock held)
+ */
+static void dma_chain_set_end(timing_card_data *card, timing_seq *seq,
+			      int ring) {
+
+  int n;
+  timing_seq *next;
+  plx9080_dma_desc *desc;
+
+  n = seq->seg_count;
+  desc = &seq->desc[ring * n + n - 1];
+
+  if ( seq->num + 1 != card->q_tail ) {
+    next = dma_seq_at(card, seq->num + 1);
+    desc->next = cpu_to_le32(next->desc_bus | PLX9080_DMADPR_PCI_SPACE |
+			     PLX9080_DMADPR_TC_INT);
+    seq->end_link[ring] = 1;
+  }
+  else {
+    desc->next = cpu_to_le32(PLX9080_DMADPR_PCI_SPACE |
+			     PLX9080_DMADPR_END_CHAIN);
+    seq->end_link[ring] = 0;
+  }
+
+  wmb();
+
+  return;
+} /* end dma_chain_set_end */
+
+/*
+   A sequence was queued behind seq, link seq's last copy to
+   it (dma_lock held). The copy playing the last cycle ends
+   in END_CHAIN, so linking it is safe even while the bridge
+   is in it: if it already fetched that descriptor the chain
+   ends and dma_chain_done starts the next one from the
+   interrupt, which the FIFO covers; else it follows the link
+   and dma_chain_cycle retires seq.
+
+   A loop copy links to the other copy instead, and which one
+   the bridge is in can't be told from cycles_done, which
+   lags it by the interrupts not yet handled. Both copies are
+   linked: one the bridge already left by its old link ends
+   in the other, so the loop ends after one or two copies and
+   dma_chain_cycle asks the bridge before retiring it.
+ */
+static void dma_chain_splice(timing_card_data *card, timing_seq *seq) {
+
+  int last;
+
+  if ( !seq->cycles ) {
+    dma_chain_set_end(card, seq, 0);
+    dma_chain_set_end(card, seq, 1);
+    return;
+  }
+
+  /* dma_chain_cycle marks the last copy when it comes up */
+  if ( seq->cycles_done + 2 < seq->cycles )
+    return;
+
+  last = (seq->cycles - 1) % seq->rings;
+  dma_chain_set_end(card, seq, last);
+
+  return;
+} /* end dma_chain_splice */
+
+/*
+   Is the bridge on one of seq's descriptors? DMADPR1 holds
+   the next field of the descriptor being played, which is
+   unique within seq except for the copies' ends, and those
+   all belong to seq. (dma_lock held)
+ */
+static int dma_chain_on(timing_card_data *card, timing_seq *seq) {
+
+  int i;
+  u32 dpr;
+
+  dpr = ioread32(card->port[12].base + PLX9080_DMADPR1);
+
+  for ( i = 0; i < seq->rings * seq->seg_count; i++ )
+    if ( le32_to_cpu(seq->desc[i].next) == dpr )
+      return 1;
+
+  return 0;
+} /* end dma_chain_on */
+
+/*
+   The chain finished a copy of the head sequence (dma_lock
+   held). Either it went on into the next sequence, or it
+   plays the sequence again; the copy that finished is played
+   after the other one, so end it if that is the last cycle.
+   A loop is only retired once the bridge has left it (see
+   dma_chain_splice), since the reaper hands its buffers back.
+ */
+static void dma_chain_cycle(timing_card_data *card) {
+
+  int ring;
+  timing_seq *seq;
+
+  seq = dma_seq_at(card, card->q_head);
+
+  ring = seq->cycles_done % seq->rings;
+  seq->cycles_done++;
+
+  if ( seq->end_link[ring] && (seq->cycles || !dma_chain_on(card, seq)) ) {
+    seq = dma_seq_retire(card);
+    if ( seq )
+      card->dma_size = seq->bytes;
+    return;
+  }
+
+  if ( seq->cycles && seq->cycles_done + 2 == seq->cycles )
+    dma_chain_set_end(card, seq, ring);
+
+  return;
+} /* end dma_chain_cycle */
+
+/*
+   The chain ran off its end (dma_lock held): the head was
+   the last sequence queued, or the next one was queued too
+   late to be linked and starts now.
+ */
+static void dma_chain_done(timing_card_data *card) {
+
+  timing_seq *seq;
+
+  seq = dma_seq_retire(card);
+  if ( seq )
+    dma_chain_start(card, seq);
+  else {
+    card->dma_running = 0;
+    if ( card->output_enabled )
+      card->stats.stalls++;
+  }
+
+  return;
+} /* end dma_chain_done */
+
+/*
+   Refill engine used up the head sequence (dma_lock held).
+   Rewind it if it is to be played again, else move on to the
+   next sequence queued; a loop ends at the end of a cycle
+   once something is queued behind it. Returns non-zero if
+   there is more to send.
+ */
+static int dma_next_cycle(timing_card_data *card) {
+
+  timing_seq *seq;
+
+  seq = dma_seq_at(card, card->q_head);
+  seq->cycles_done++;
+
+  if ( seq->cycles ? seq->cycles_done < seq->cycles :
+       card->q_head + 1 == card->q_tail ) {
+    card->total_size  = seq->bytes;
+    card->dma_seg_idx = 0;
+    card->dma_seg_off = 0;
+    return 1;
+  }
+
+  seq = dma_seq_retire(card);
+  if ( !seq )
+    return 0;
+
+  dma_seq_cursor(card, seq);
+
+  return 1;
+} /* end dma_next_cycle */
+
+/*                 *****                 */
+/*             *************             */
+/*         *********************         */
+/*     *****************************     */
+/* ************************************* */
+/* ******** REFILL CONTROLLER ********** */
+/* ************************************* */
+/*     *****************************     */
+/*         *********************         */
+/*             *************             */
+/*                 *****                 */
+
+/*
+   The "full implementation" from readme.txt. Every completed
+   transfer is a sample of Tt per byte; we keep an EWMA and a
+   slowly decaying worst case of it, and a model of the FIFO
+   level (words) as a value at a timestamp that drains at one
+   word per clock period while output is enabled.
+
+   The next transfer starts when the FIFO reaches a low water
+   mark L and is C words long. To never underrun, L words must
+   outlast the worst case transfer of C plus a margin m:
+
+        L * P >= C * r + m           (P ns/word out, r ns/word in)
+
+   and to never overrun, L + C <= F - g (F FIFO depth, g guard
+   words). Taking C = F - g - L and solving for L gives
+
+        L = ((F - g) * r + m) / (P + r)
+
+   so a fast bus gives a low L and big chunks, a slow bus a high
+   L and small chunks. The wait Wt' is the time for the current
+   level to drain down to L.
+ */
+
+/* FIFO level in words at now_ns, as the model sees it */
+static u64 refill_level_at(timing_card_data *card, s64 now_ns) {
+
+  u64 drained, period;
+
+  period = card->ns_clock_period;
+  if ( !card->output_enabled || !period ||
+       now_ns <= card->refill.level_ns )
+    return card->refill.level_words;
+
+  drained = div64_u64(now_ns - card->refill.level_ns, period);
+
+  return drained >= card->refill.level_words ? 
+    0 : card->refill.level_words - drained;
+} /* end refill_level_at */
+
+/* a transfer starts now, remember where the FIFO stood */
+static void refill_mark_start(timing_card_data *card, s64 now_ns) {
+
+  card->refill.start_words = refill_level_at(card, now_ns);
+
+  return;
+} /* end refill_mark_start */
+
+/* a transfer of bytes took tt_ns, update level and Tt statistics */
+static void refill_update(timing_card_data *card, size_t bytes, s64 tt_ns) {
+
+  u64 sample, level, drained, period;
+
+  /* handshake clock (period 0): no model to update */
+  period = card->ns_clock_period;
+  if ( !bytes || tt_ns <= 0 || !period || !card->fifo_width )
+    return;
+
+  /* FIFO gained the words and drained during the transfer */
+  drained = card->output_enabled ? div64_u64(tt_ns, period) : 0;
+  level = card->refill.start_words + bytes / card->fifo_width;
+  level = drained >= level ? 0 : level - drained;
+
+  card->refill.level_words = MIN(level, (u64)FIFO_SIZE);
+  card->refill.level_ns = card->end_ns;
+
+  /* cost of moving a byte, picoseconds for resolution */
+  sample = div64_u64((u64)tt_ns * 1000, bytes);
+
+  if ( !card->refill.samples ) {
+    card->refill.ewma_ps_per_byte  = sample;
+    card->refill.worst_ps_per_byte = sample;
+  }
+  else {
+    /* EWMA with weight 1/8 */
+    card->refill.ewma_ps_per_byte = card->refill.ewma_ps_per_byte - 
+      (card->refill.ewma_ps_per_byte >> 3) + (sample >> 3);
+
+    /* worst case forgets by 1/64 per sample */
+    card->refill.worst_ps_per_byte -= card->refill.worst_ps_per_byte >> 6;
+    if ( sample > card->refill.worst_ps_per_byte )
+      card->refill.worst_ps_per_byte = sample;
+  }
+  card->refill.samples++;
+
+  return;
+} /* end refill_update */
+
+/* choose refill.next_bytes and dma_delay from the statistics */
+static void refill_plan(timing_card_data *card) {
+
+  u64 r, p, m, room, low, chunk, period;
+
+  period = card->ns_clock_period;
+  if ( !period )
+    return;
+
+  /* ps per word in (worst case) and out */
+  r = card->refill.worst_ps_per_byte * card->fifo_width;
+  p = period * 1000;
+  m = (u64)refill_margin_us * 1000 * 1000;
+
+  room = FIFO_SIZE - MIN((u64)refill_guard_words, (u64)FIFO_SIZE / 2);
+
+  low = div64_u64(room * r + m + p + r - 1, p + r);
+
+  /* bus can't keep up, take the smallest sane chunk */
+  if ( low + REFILL_MIN_WORDS > room )
+    low = room - REFILL_MIN_WORDS;
+
+  chunk = room - low;
+
+  card->refill.low_words  = low;
+  card->refill.next_bytes = chunk * card->fifo_width;
+
+  /* Wt' = time for the FIFO to drain down to the low mark */
+  if ( card->refill.level_words > low )
+    card->dma_delay = (card->refill.level_words - low) * period;
+  else
+    card->dma_delay = 0;
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "refill plan: ewma %llu worst %llu ps/B, "
+	 "level %llu low %llu chunk %llu words\n",
+	 card->refill.ewma_ps_per_byte, card->refill.worst_ps_per_byte,
+	 card->refill.level_words, low, chunk);
+ #endif
+
+  return;
+} /* end refill_plan */
+
+/* function to probe settings on DO_CSR for DMA */
+void configure_for_dma(timing_card_data *card) {
+      
+  u32 tmp32;
+  int width;
+  u64 period;
+  unsigned long flags;
+
+  tmp32 = ioread32(card->port[1].base);
+
+  /* determine fifo width */
+  if ( tmp32 & 0x01 )
+    width = 4;
+  else
+    width = 2; /* NOTE -- could be 1... no way to tell? */
+
+  /* determine clock period */
+  switch ( (tmp32 & 0x06) >> 1 ) {
+
+  case  0x00 :
+    /* custom clock width */
+    period = 10000;
+    break;
+
+  case 0x01 :
+    period = 50;
+    break;
+	
+  case 0x02 :
+    period = 100;
+    break;
+
+  case 0x03 :
+  default   :
+    period = 0; /* lets hope not */
+    break;
+
+  } /* end switch */
+
+  /* the IRQ and refill timer read all of these under dma_lock */
+  spin_lock_irqsave(&card->dma_lock, flags);
+
+  card->fifo_width = width;
+  card->ns_clock_period = period;
+
+  /* output enabled status */
+  if ((tmp32 & 0x128) == 0x100) {
+
+    /* FIFO starts draining now */
+    if ( !card->output_enabled )
+      card->refill.level_ns = ktime_to_ns(ktime_get());
+
+    card->output_enabled = 1;
+
+    /* refill planned before output started, time it from now */
+    if ( card->dma_waiting ) {
+      card->dma_waiting = 0;
+      if ( card->dma_running )
+	refill_arm(card, card->refill.level_ns);
+    }
+  }
+  else
+    card->output_enabled = 0;
+
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  card->dma_configured = 1;
+
+  return;
+} /* end configure function */
+
+/*
+   Arm the scheduled start: at the absolute time in sa, on
+   CLOCK_REALTIME or CLOCK_TAI, sa->do_csr is written to the
+   DO_CSR with the output enable bit set. Whatever is queued
+   on the DO FIFO by then has primed the FIFO, so output
+   begins on the instant rather than when a process gets to
+   write /dev/timing1. With di, di_csr is written to the
+   DI_CSR just before, for a duplex start. A later call
+   replaces an armed start.
+ */
+static int timing_start_at(timing_card_data *card,
+			   struct timing_start_at *sa, int di, u32 di_csr) {
+
+  clockid_t clock;
+  ktime_t when, now;
+
+  if ( sa->tv_nsec >= NSEC_PER_SEC )
+    return -EINVAL;
+
+  switch ( sa->clock ) {
+  case TIMING_CLOCK_REALTIME :
+    clock = CLOCK_REALTIME;
+    now = ktime_get_real();
+    break;
+  case TIMING_CLOCK_TAI :
+    clock = CLOCK_TAI;
+    now = ktime_get_clocktai();
+    break;
+  default :
+    return -EINVAL;
+  }
+
+  when = ktime_set(sa->tv_sec, sa->tv_nsec);
+
+  /* too late to start on the instant, let user space decide */
+  if ( ktime_compare(when, now) <= 0 )
+    return -ETIME;
+
+  mutex_lock(&card->dma_mutex);
+
+  hrtimer_cancel(&card->start_timer);
+
+  /* clearing the FIFO would throw away the priming */
+  card->start_csr = (sa->do_csr & ~DO_CSR_CLEAR_FIFO) | DO_CSR_ENABLE;
+  card->start_di = di;
+  card->start_di_csr = di_csr;
+
+  /* hard expiry, the write must not wait for softirq */
+  hrtimer_init(&card->start_timer, clock, HRTIMER_MODE_ABS_HARD);
+  card->start_timer.function = start_timer_fn;
+  hrtimer_start(&card->start_timer, when, HRTIMER_MODE_ABS_HARD);
+
+  mutex_unlock(&card->dma_mutex);
+
+  return 0;
+} /* end timing_start_at */
+
+/* the scheduled instant, turn the output on */
+static enum hrtimer_restart start_timer_fn(struct hrtimer *timer) {
+
+  timing_card_data *card;
+
+  card = container_of(timer, timing_card_data, start_timer);
+
+  /* first thing, everything else can wait */
+  timing_output_start(card);
+
+  card->start_late_ns = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer),
+					      hrtimer_get_expires(timer)));
+
+  /* FIFO draining starts now, refills are timed from here */
+  configure_for_dma(card);
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "timing%d: output started %lld ns late\n",
+	 card->index, card->start_late_ns);
+ #endif
+
+  return HRTIMER_NORESTART;
+} /* end start_timer_fn */
+
+/*
+   The start event: DI_CSR (for a duplex start) and DO_CSR
+   written back to back, capture first so it sees the first
+   output word. Both streams count from output_start_ns.
+   (interrupts off)
+ */
+static void timing_output_start(timing_card_data *card) {
+
+  if ( card->start_di )
+    iowrite32(card->start_di_csr, card->port[0].base);
+  iowrite32(card->start_csr, card->port[1].base);
+
+  card->output_start_ns = ktime_to_ns(ktime_get());
+
+  return;
+} /* end timing_output_start */
+
+/*
+   TIMING_IOC_PATTERN. In pattern generator mode the 7300A
+   plays its FIFO over and over by itself, so a sequence of
+   one FIFO or less needs no DMA at all once loaded. The DO
+   stream is stopped (the FIFO can't be both), the FIFO is
+   cleared and loaded by programmed I/O with the pattern
+   bit set and the output off, then the DO_CSR is left as
+   given, output enabled only with TIMING_PATTERN_START.
+   Until a DO_CSR write clears the pattern bit, nothing can
+   be queued on the DO FIFO (dma_pattern_busy).
+ */
+static int timing_pattern_load(timing_card_data *card,
+			       struct timing_pattern *pat) {
+
+  u32 csr, *words;
+
+  if ( !pat->length || !IS_ALIGNED(pat->length, 4) ||
+       pat->length > TIMING_PATTERN_MAX_WORDS * 4 )
+    return -EINVAL;
+
+  words = memdup_user(u64_to_user_ptr(pat->words), pat->length);
+  if ( IS_ERR(words) )
+    return PTR_ERR(words);
+
+  csr = (pat->do_csr | DO_CSR_PAT_GEN) & ~(DO_CSR_ENABLE | DO_CSR_CLEAR_FIFO);
+
+  mutex_lock(&card->dma_mutex);
+  dma_stop_stream(card);
+
+  mutex_lock(&card->reg_mutex);
+
+  iowrite32(csr | DO_CSR_CLEAR_FIFO, card->port[1].base);
+  iowrite32_rep(card->port[5].base, words, pat->length / 4);
+
+  if ( pat->flags & TIMING_PATTERN_START ) {
+    card->start_di  = 0;
+    card->start_csr = csr | DO_CSR_ENABLE;
+    timing_output_start(card);
+  }
+  else
+    iowrite32(csr, card->port[1].base);
+
+  configure_for_dma(card);
+
+  mutex_unlock(&card->reg_mutex);
+  mutex_unlock(&card->dma_mutex);
+
+  kfree(words);
+
+  return 0;
+} /* end timing_pattern_load */
+
+/* -EBUSY while the DO FIFO is in pattern generator mode */
+static int dma_pattern_busy(timing_card_data *card) {
+
+  return ioread32(card->port[1].base) & DO_CSR_PAT_GEN ? -EBUSY : 0;
+} /* end dma_pattern_busy */
+
+/*
+   TIMING_IOC_DUPLEX: arm DI capture on channel 0, then
+   enable DI and DO together, now or at dx->at. The DO
+   sequence should be queued first so channel 1 has primed
+   the FIFO. Channel 0 waits on the DI FIFO, which only fills
+   once the DI_CSR write enables it.
+ */
+static int timing_duplex_start(timing_card_data *card,
+			       struct timing_duplex *dx) {
+
+  int rc;
+  unsigned long flags;
+
+  mutex_lock(&card->di_mutex);
+
+  rc = di_start(card);
+  if ( rc )
+    goto out;
+
+  if ( !(dx->flags & TIMING_DUPLEX_NOW) ) {
+    rc = timing_start_at(card, &dx->at, 1, dx->di_csr);
+    if ( rc )
+      di_stop(card);
+    goto out;
+  }
+
+  mutex_lock(&card->dma_mutex);
+
+  hrtimer_cancel(&card->start_timer);
+  card->start_csr = (dx->at.do_csr & ~DO_CSR_CLEAR_FIFO) | DO_CSR_ENABLE;
+  card->start_di = 1;
+  card->start_di_csr = dx->di_csr;
+
+  /* keep the two writes together */
+  local_irq_save(flags);
+  timing_output_start(card);
+  local_irq_restore(flags);
+
+  configure_for_dma(card);
+  dx->start_ns = card->output_start_ns;
+
+  mutex_unlock(&card->dma_mutex);
+
+ out:
+  mutex_unlock(&card->di_mutex);
+
+  return rc;
+} /* end timing_duplex_start */
+
+/* 
+   Called when the device is written to --
+
+   Note: There are 3 different components we could write to.
+         This function deals only with writing to the 7300
+	 registers. Writing to the 8254 timer or the 9080 chip
+	 is dealt with in seperate functions.
+*/
+static ssize_t timing_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *f_pos) {
+
+  int rc, curr_count, offset, remaining;
+  timing_dev_data *my_dev;
+  timing_card_data *card;
+  uint32_t bounce_buff;
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "timing_write() entry\n");
+ #endif
+
+  my_dev = filp->private_data;
+  card = my_dev->card;
+
+  /* timing chip only takes 1 byte... */
+  if ( my_dev->component == TIMER8254_ID) 
+    return chip_8254_write(filp, buf, count, f_pos);
+
+  /* writing to FIFO we want DMA */
+  if ( my_dev == &card->port[5] )
+    return dma_transfer(filp, buf, count, f_pos);
+
+  /* going to write MAX 32 bytes at a time */
+  remaining = count;
+  offset = 0;
+
+  /* no batch in between our words */
+  mutex_lock(&card->reg_mutex);
+
+  /* while we still need to write */
+  while ( remaining > 0 ) {
+    
+    bounce_buff = 0x0;
+
+    /* if we're going to need to write more than 1 */
+    if ( remaining > 4 ) {
+      curr_count = 4;
+      remaining -= 4;
+    }
+    else {
+      curr_count = remaining;
+      remaining = 0;
+    }
+    
+    /* get data */
+    rc = copy_from_user(&bounce_buff, buf + offset, curr_count);
+    if (rc) {
+      printk(KERN_ALERT "timing_write() bad copy_from_user\n");
+      mutex_unlock(&card->reg_mutex);
+      return -EFAULT;
+    }
+
+    offset += curr_count;
+
+    bounce_buff = cpu_to_le32(bounce_buff);
+
+   #if DEBUG != 0
+    printk(KERN_DEBUG "timing_write recvd %x\n", bounce_buff);
+   #endif
+    
+    /* write data */
+    iowrite32(bounce_buff, my_dev->base);
+
+    /* if its the last write to the DO_CSR */
+    if ( !remaining && (my_dev == &card->port[1]) )
+      configure_for_dma(card);
+  }
+
+  mutex_unlock(&card->reg_mutex);
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "timing_write() exit success\n");
+ #endif 
+
+  return count - remaining;
+} /* end timing_write */
+
+/* 
+   Writing to the 7300 registers is done in 32 bit words while 
+       writing to the 8254 chip is done in 8 bits. 
+ */
+static ssize_t chip_8254_write(struct file *filp, const char __user *buf,
+			       size_t count, loff_t *f_pos) {
+  int rc;
+  timing_dev_data *dev;
+  unsigned char msg;
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "8254_write() entry\n");
+ #endif
+
+  /* retrieve device data */
+  dev = filp->private_data;
+
+  /* 8254 commands and data are just 1 byte */
+  if ( count != 1 ) {
+    printk(KERN_WARNING "8254 registers are just 8 bits wide\n");
+    return -EINVAL;
+  }
+
+  /* do actual data retrieval */
+  rc = copy_from_user(&msg, buf, count);
+  if ( rc < 0 ) {
+    printk(KERN_ALERT "8254_write bad copy from user\n");
+    return -EFAULT;
+  }
+
+  /* preform IO */
+  mutex_lock(&dev->card->reg_mutex);
+  iowrite8(msg, dev->base);
+  mutex_unlock(&dev->card->reg_mutex);
+
+ #if DEBUG != 0
+  printk(KERN_DEBUG "8254_write() exit success\n");
+ #endif
+
+  return count;
+} /* end 8284_chip_write function */
+
+/*
+   One register write of a value already in the kernel, as
+   timing_write or chip_8254_write would do it: a byte to the
+   8254, a 32 bit word anywhere else, reconfiguring the DMA
+   after a DO_CSR write.
+ */
+static void timing_reg_write(timing_dev_data *dev, u32 value) {
+
+  timing_card_data *card = dev->card;
+
+  mutex_lock(&card->reg_mutex);
+
+  if ( dev->component == TIMER8254_ID ) {
+    iowrite8(value, dev->base);
+  }
+  else {
+    iowrite32(cpu_to_le32(value), dev->base);
+    if ( dev == &card->port[1] )
+      configure_for_dma(card);
+  }
+
+  mutex_unlock(&card->reg_mutex);
+
+  return;
+} /* end timing_reg_write */
+
+/*
+   Check a register operation of TIMING_IOC_REG_BATCH. The
+   port is the device index within the card (as the minor):
+   7300 ports take whole 4 byte words, the 8254 single bytes,
+   and the PLX LCR 1, 2 or 4 bytes at an aligned offset. The
+   DO FIFO belongs to the DMA stream and is refused.
+ */
+static int reg_op_check(timing_card_data *card, struct timing_reg_op *op) {
+
+  timing_dev_data *dev;
+
+  if ( op->port >= TIMING_DEV_COUNT || op->port == 5 ||
+       (op->flags & ~(TIMING_REG_READ | TIMING_REG_READBACK)) )
+    return -EINVAL;
+
+  dev = &card->port[op->port];
+
+  switch ( dev->component ) {
+
+  case PCI7300_ID :
+    return op->reg == 0 && op->width == 4 ? 0 : -EINVAL;
+
+  case TIMER8254_ID :
+    return op->reg == 0 && op->width == 1 ? 0 : -EINVAL;
+
+  default :
+    if ( op->width != 1 && op->width != 2 && op->width != 4 )
+      return -EINVAL;
+    if ( op->reg % op->width || op->reg + op->width > 0x100 )
+      return -EINVAL;
+    return 0;
+  }
+} /* end reg_op_check */
+
+/*
+   TIMING_IOC_REG_BATCH: apply count register operations in
+   order with reg_mutex held, so no write() to the registers
+   lands in between. Every op is checked before any is
+   applied. Reads, and readbacks after writes, are returned
+   in the ops' value fields.
+ */
+static int timing_reg_batch(timing_card_data *card,
+			    struct timing_reg_batch *batch) {
+
+  int i, rc, csr;
+  void __iomem *addr;
+  struct timing_reg_op *ops, *op;
+
+  if ( !batch->count )
+    return 0;
+  if ( batch->count > TIMING_REG_BATCH_MAX )
+    return -E2BIG;
+
+  ops = memdup_user(u64_to_user_ptr(batch->ops),
+		    batch->count * sizeof(*ops));
+  if ( IS_ERR(ops) )
+    return PTR_ERR(ops);
+
+  for ( i = 0; i < batch->count; i++ ) {
+    rc = reg_op_check(card, &ops[i]);
+    if ( rc )
+      goto out;
+  }
+
+  mutex_lock(&card->reg_mutex);
+
+  for ( i = 0, csr = 0; i < batch->count; i++ ) {
+
+    op = &ops[i];
+    addr = card->port[op->port].base + op->reg;
+
+    if ( !(op->flags & TIMING_REG_READ) ) {
+      if ( op->width == 4 )
+	iowrite32(op->value, addr);
+      else if ( op->width == 2 )
+	iowrite16(op->value, addr);
+      else
+	iowrite8(op->value, addr);
+
+      if ( op->port == 1 )
+	csr = 1;
+    }
+
+    if ( op->flags & (TIMING_REG_READ | TIMING_REG_READBACK) ) {
+      if ( op->width == 4 )
+	op->value = ioread32(addr);
+      else if ( op->width == 2 )
+	op->value = ioread16(addr);
+      else
+	op->value = ioread8(addr);
+    }
+  }
+
+  /* as timing_write does after a DO_CSR write */
+  if ( csr )
+    configure_for_dma(card);
+
+  mutex_unlock(&card->reg_mutex);
+
+  rc = 0;
+  if ( copy_to_user(u64_to_user_ptr(batch->ops), ops,
+		    batch->count * sizeof(*ops)) )
+    rc = -EFAULT;
+
+ out:
+  kfree(ops);
+
+  return rc;
+} /* end timing_reg_batch */
+
+/*
+   TIMING_IOC_STATUS: every status register worth polling in
+   one pass. The 8254 counters are latched together with one
+   read-back command, so their counts are from the same
+   instant; reg_mutex keeps register writes through the driver
+   out of the middle of it. The DI/DO FIFO ports are not read,
+   that would pop them.
+ */
+static void timing_status_snapshot(timing_card_data *card,
+				   struct timing_status *st) {
+
+  int c;
+  u8 status, lo, hi;
+  unsigned long flags;
+  void __iomem *lcr = card->port[12].base;
+
+  memset(st, 0, sizeof(*st));
+
+  mutex_lock(&card->reg_mutex);
+
+  st->time_ns = ktime_get_ns();
+
+  st->di_csr  = ioread32(card->port[0].base);
+  st->do_csr  = ioread32(card->port[1].base);
+  st->aux_dio = ioread32(card->port[2].base);
+  st->int_csr = ioread32(card->port[3].base);
+
+  /* latch count and status of counters 0-2 at once */
+  iowrite8(READBACK_8254_ALL, card->port[11].base);
+
+  for ( c = 0; c < 3; c++ ) {
+
+    /* status first, it says how the count is to be read */
+    status = ioread8(card->port[8 + c].base);
+    lo = hi = 0;
+
+    switch ( (status >> 4) & 0x3 ) {
+    case 0x1 :
+      lo = ioread8(card->port[8 + c].base);
+      break;
+    case 0x2 :
+      hi = ioread8(card->port[8 + c].base);
+      break;
+    case 0x3 :
+      lo = ioread8(card->port[8 + c].base);
+      hi = ioread8(card->port[8 + c].base);
+      break;
+    }
+
+    st->counter_status[c] = status;
+    st->counter[c] = (hi << 8) | lo;
+  }
+
+  st->plx_intcsr  = ioread32(lcr + PLX9080_INTCSR);
+  st->plx_dmacsr0 = ioread8(lcr + PLX9080_DMACSR0);
+  st->plx_dmacsr1 = ioread8(lcr + PLX9080_DMACSR1);
+  st->plx_dmasiz1 = ioread32(lcr + PLX9080_DMASIZ1);
+  st->plx_dmadpr1 = ioread32(lcr + PLX9080_DMADPR1);
+
+  mutex_unlock(&card->reg_mutex);
+
+  spin_lock_irqsave(&card->dma_lock, flags);
+  st->queue_head = card->q_head;
+  st->queue_tail = card->q_tail;
+  if ( card->dma_running )
+    st->flags |= TIMING_STATUS_RUNNING;
+  if ( card->output_enabled )
+    st->flags |= TIMING_STATUS_OUTPUT;
+  if ( st->do_csr & DO_CSR_PAT_GEN )
+    st->flags |= TIMING_STATUS_PATTERN;
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  return;
+} /* end timing_status_snapshot */
+
+long timing_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+  timing_dev_data *dev;
+  timing_card_data *card;
+  struct timing_pool_info info;
+  struct timing_submit sub;
+  struct timing_rle rle;
+  struct timing_wave_load wl;
+  struct timing_wave_list wlist;
+  struct timing_pattern pat;
+  __u32 id;
+  struct timing_start_at sa;
+  struct timing_stats stats;
+  struct timing_reg_batch batch;
+  struct timing_status status;
+  struct timing_di_info di;
+  struct timing_duplex dx;
+  __u32 blocks;
+  int rc;
+  unsigned long flags;
+  __u32 cycles;
+
+  /* retrieve device info */
+  dev = filp->private_data;
+  card = dev->card;
+
+  switch(cmd) {
+
+  case TIMING_IOC_POOL_INFO:
+
+    info.buf_size  = card->dma_pool_buf_size;
+    info.buf_count = card->dma_pool_count;
+
+    if ( copy_to_user((void __user *)arg, &info, sizeof(info)) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_POOL_INFO */
+
+  case TIMING_IOC_SUBMIT:
+
+    /* only the DO FIFO streams from the pool */
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&sub, (void __user *)arg, sizeof(sub)) )
+      return -EFAULT;
+
+    /* the FIFO takes whole 32-bit words */
+    if ( (sub.offset | sub.length) & 3 )
+      return -EINVAL;
+
+    if ( !sub.length )
+      return 0;
+
+    /* data is already in place, just queue it */
+    return dma_submit(card, filp, NULL, NULL, sub.offset, sub.length);
+  /* END CASE TIMING_IOC_SUBMIT */
+
+  case TIMING_IOC_SUBMIT_RLE:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&rle, (void __user *)arg, sizeof(rle)) )
+      return -EFAULT;
+
+    return dma_submit_rle(card, filp, &rle);
+  /* END CASE TIMING_IOC_SUBMIT_RLE */
+
+  case TIMING_IOC_WAVE_LOAD:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&wl, (void __user *)arg, sizeof(wl)) )
+      return -EFAULT;
+
+    rc = wave_load(card, &wl);
+    if ( rc )
+      return rc;
+
+    if ( put_user(wl.id, &((struct timing_wave_load __user *)arg)->id) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_WAVE_LOAD */
+
+  case TIMING_IOC_WAVE_PLAY:
+  case TIMING_IOC_WAVE_EVICT:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( get_user(id, (__u32 __user *)arg) )
+      return -EFAULT;
+
+    if ( cmd == TIMING_IOC_WAVE_PLAY )
+      return dma_submit_wave(card, filp, id);
+
+    return wave_evict(card, id);
+  /* END CASE TIMING_IOC_WAVE_PLAY/EVICT */
+
+  case TIMING_IOC_WAVE_LIST:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&wlist, (void __user *)arg, sizeof(wlist)) )
+      return -EFAULT;
+
+    rc = wave_list(card, &wlist);
+    if ( rc )
+      return rc;
+
+    if ( copy_to_user((void __user *)arg, &wlist, sizeof(wlist)) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_WAVE_LIST */
+
+  case TIMING_IOC_PATTERN:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&pat, (void __user *)arg, sizeof(pat)) )
+      return -EFAULT;
+
+    return timing_pattern_load(card, &pat);
+  /* END CASE TIMING_IOC_PATTERN */
+
+  case TIMING_IOC_SET_CYCLES:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( get_user(cycles, (__u32 __user *)arg) )
+      return -EFAULT;
+
+    /* takes effect with the next sequence sent */
+    mutex_lock(&card->dma_mutex);
+    card->cycles = cycles;
+    mutex_unlock(&card->dma_mutex);
+
+    return 0;
+  /* END CASE TIMING_IOC_SET_CYCLES */
+
+  case TIMING_IOC_STOP:
+
+    if ( dev != &card->port[5] )
+      return -ENOTTY;
+
+    mutex_lock(&card->dma_mutex);
+    dma_stop_stream(card);
+    mutex_unlock(&card->dma_mutex);
+
+    return 0;
+  /* END CASE TIMING_IOC_STOP */
+
+  case TIMING_IOC_START_AT:
+
+    /* it is the DO_CSR that gets written */
+    if ( dev != &card->port[1] && dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&sa, (void __user *)arg, sizeof(sa)) )
+      return -EFAULT;
+
+    return timing_start_at(card, &sa, 0, 0);
+  /* END CASE TIMING_IOC_START_AT */
+
+  case TIMING_IOC_GET_STATS:
+
+    spin_lock_irqsave(&card->dma_lock, flags);
+    stats = card->stats;
+    spin_unlock_irqrestore(&card->dma_lock, flags);
+
+    if ( copy_to_user((void __user *)arg, &stats, sizeof(stats)) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_GET_STATS */
+
+  case TIMING_IOC_CLEAR_STATS:
+
+    stats_clear(card);
+
+    return 0;
+  /* END CASE TIMING_IOC_CLEAR_STATS */
+
+  case TIMING_IOC_REG_BATCH:
+
+    if ( copy_from_user(&batch, (void __user *)arg, sizeof(batch)) )
+      return -EFAULT;
+
+    return timing_reg_batch(card, &batch);
+  /* END CASE TIMING_IOC_REG_BATCH */
+
+  case TIMING_IOC_STATUS:
+
+    timing_status_snapshot(card, &status);
+
+    if ( copy_to_user((void __user *)arg, &status, sizeof(status)) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_STATUS */
+
+  case TIMING_IOC_DI_START:
+  case TIMING_IOC_DI_STOP:
+
+    /* capture belongs to the DI FIFO */
+    if ( dev != &card->port[4] )
+      return -ENOTTY;
+
+    mutex_lock(&card->di_mutex);
+    rc = 0;
+    if ( cmd == TIMING_IOC_DI_START )
+      rc = di_start(card);
+    else
+      di_stop(card);
+    mutex_unlock(&card->di_mutex);
+
+    return rc;
+  /* END CASE TIMING_IOC_DI_START/STOP */
+
+  case TIMING_IOC_DI_INFO:
+
+    if ( dev != &card->port[4] )
+      return -ENOTTY;
+
+    di_info(card, &di);
+
+    if ( copy_to_user((void __user *)arg, &di, sizeof(di)) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_DI_INFO */
+
+  case TIMING_IOC_DI_RELEASE:
+
+    if ( dev != &card->port[4] )
+      return -ENOTTY;
+
+    if ( get_user(blocks, (__u32 __user *)arg) )
+      return -EFAULT;
+
+    mutex_lock(&card->di_mutex);
+    di_release(card, blocks);
+    mutex_unlock(&card->di_mutex);
+
+    return 0;
+  /* END CASE TIMING_IOC_DI_RELEASE */
+
+  case TIMING_IOC_DUPLEX:
+
+    if ( dev != &card->port[1] && dev != &card->port[4] &&
+	 dev != &card->port[5] )
+      return -ENOTTY;
+
+    if ( copy_from_user(&dx, (void __user *)arg, sizeof(dx)) )
+      return -EFAULT;
+
+    dx.start_ns = 0;
+    rc = timing_duplex_start(card, &dx);
+    if ( rc )
+      return rc;
+
+    if ( copy_to_user((void __user *)arg, &dx, sizeof(dx)) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_DUPLEX */
+
+  case TIMING_IOC_START_TIME:
+
+    if ( put_user((__s64)READ_ONCE(card->output_start_ns),
+		  (__s64 __user *)arg) )
+      return -EFAULT;
+
+    return 0;
+  /* END CASE TIMING_IOC_START_TIME */
+
+  case CHANGE_PLX_OFFSET:
+    
+    /* make sure this is the correct device */
+    if ( dev->component != PLX9080_ID ) {
+      printk(KERN_ALERT "TIMING_IOCTL CHANGE_PLX_OFFSET device NOT PLX\n");
+      return -ENOTTY;
+    }
+
+    /* offset must be positive and less than 0x100 (see plx 9080 datasheet */
+    if ( arg < 0 || arg > 0x100 ) { 
+      printk(KERN_ALERT "TIMING_IOCTL CHANGE_PLX_OFFSET bad argument\n");
+      return -ENOTTY;
+    }
+    
+    dev->offset = arg;
+
+   #if DEBUG != 0
+    printk(KERN_DEBUG "new plx9080 offset is -- %x", dev->offset);
+   #endif
+    
+    return 0; /* success */
+  /* END CASE CHANGE_PLX_OFFSET */
+
+  default:
+    printk(KERN_DEBUG "TIMING_IOCTL bad command\n");
+    return -ENOTTY;
+
+  } /* end command switch statement */
+
+  /* never reached */
+  return -EINVAL;
+} /* end of ioctl command */
+
+/* only the DO FIFO can be mapped, and it maps the DMA pool */
+static int timing_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+  int rc;
+  timing_dev_data *dev;
+  timing_card_data *card;
+
+  dev = filp->private_data;
+  card = dev->card;
+
+  if ( dev == &card->port[5] )
+    return dma_pool_mmap(card, vma);
+
+  if ( dev == &card->port[4] ) {
+    rc = dma_segs_mmap(card, card->di_ring, card->di_blocks,
+		       card->di_block_size, vma);
+    if ( rc )
+      return rc;
+
+    vma->vm_ops = &timing_vm_ops;
+    vma->vm_private_data = card;
+    timing_vm_open(vma);
+    return 0;
+  }
+
+  /* the LCR device maps BAR 1, every other one BAR 2 */
+  if ( dev->component == PLX9080_ID )
+    return timing_bar_mmap(card, PLX9080_BAR, vma);
+
+  return timing_bar_mmap(card, TIMING_BAR, vma);
+} /* end timing_mmap */
+
+/*
+   Map a register BAR uncached into user space, when the
+   module was loaded with bar_mmap. Accesses made through
+   it bypass reg_mutex and configure_for_dma(), so this is
+   for privileged tooling that knows what the driver is
+   doing with the card.
+ */
+static int timing_bar_mmap(timing_card_data *card, int bar,
+			   struct vm_area_struct *vma) {
+
+  if ( !bar_mmap )
+    return -ENODEV;
+
+  if ( !capable(CAP_SYS_RAWIO) )
+    return -EPERM;
+
+  /* I/O port BARs can't be mapped */
+  if ( !(pci_resource_flags(card->pdev, bar) & IORESOURCE_MEM) )
+    return -ENODEV;
+
+  vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+  /* checks the size and offset against the BAR */
+  return vm_iomap_memory(vma, pci_resource_start(card->pdev, bar),
+			 pci_resource_len(card->pdev, bar));
+} /* end timing_bar_mmap */
+
+/* DO FIFO is writable while a queue slot is free, DI FIFO readable */
+static __poll_t timing_poll(struct file *filp, poll_table *wait) {
+
+  __poll_t mask = 0;
+  timing_dev_data *dev;
+  timing_card_data *card;
+
+  dev = filp->private_data;
+  card = dev->card;
+
+  /* DI FIFO is readable while captured blocks wait */
+  if ( dev == &card->port[4] ) {
+    poll_wait(filp, &card->di_wait, wait);
+    if ( READ_ONCE(card->di_count) )
+      mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+  }
+
+  if ( dev != &card->port[5] )
+    return DEFAULT_POLLMASK;
+
+  poll_wait(filp, &card->queue_wait, wait);
+
+  /* the same test a non-blocking write fails with EAGAIN on */
+  mutex_lock(&card->dma_mutex);
+  if ( dma_can_accept(card, card->pool_want) )
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  mutex_unlock(&card->dma_mutex);
+
+  return mask;
+} /* end timing_poll */
+
+/*                 *****                 */
+/*             *************             */
+/*         *********************         */
+/*     *****************************     */
+/* ************************************* */
+/* ******** STREAM STATISTICS ********** */
+/* ************************************* */
+/*     *****************************     */
+/*         *********************         */
+/*             *************             */
+/*                 *****                 */
+
+/*
+   Counters for the DO stream of a card, kept under dma_lock
+   by the DMA interrupt and the refill path. They are read
+   with TIMING_IOC_GET_STATS or one value per file from the
+   stats directory of the PCI device in sysfs.
+
+   The DO_CSR status bits are sampled at every DMA completion
+   (and, chained, at every end of cycle). The underrun flag
+   stays set until user space writes CLEAR_UNDER_OCSR, so an
+   underrun is counted when the flag is newly seen set. The
+   margin is how long the FIFO had left to play when a refill
+   started, from the refill controller's level model; it is
+   only known with adaptive_refill.
+ */
+
+/* a transfer (or chained cycle) of bytes completed (dma_lock held) */
+static void stats_sample(timing_card_data *card, size_t bytes) {
+
+  u32 status;
+
+  card->stats.transfers++;
+  card->stats.bytes += bytes;
+
+  status = ioread32(card->port[1].base) &
+    (DO_CSR_UNDERRUN | DO_CSR_FULL | DO_CSR_EMPTY);
+
+  if ( (status & ~card->csr_status) & DO_CSR_UNDERRUN ) {
+    card->stats.underruns++;
+    trace_timing_underrun(card->index, status);
+    printk_ratelimited(KERN_WARNING "timing%d: DO FIFO underrun\n",
+		       card->index);
+  }
+
+  card->csr_status = status;
+
+  return;
+} /* end stats_sample */
+
+/* a refill just started, how close was the FIFO to empty (dma_lock held) */
+static void stats_margin(timing_card_data *card) {
+
+  s64 margin;
+
+  if ( !adaptive_refill || !card->output_enabled || 
+       !card->ns_clock_period )
+    return;
+
+  margin = card->refill.start_words * card->ns_clock_period;
+
+  if ( card->stats.min_margin_ns < 0 || margin < card->stats.min_margin_ns )
+    card->stats.min_margin_ns = margin;
+
+  if ( margin < (s64)near_miss_us * NSEC_PER_USEC )
+    card->stats.near_misses++;
+
+  return;
+} /* end stats_margin */
+
+/* start counting afresh; a flag already latched is not counted again */
+static void stats_clear(timing_card_data *card) {
+
+  unsigned long flags;
+
+  spin_lock_irqsave(&card->dma_lock, flags);
+  memset(&card->stats, 0, sizeof(card->stats));
+  card->stats.min_margin_ns = -1;
+  spin_unlock_irqrestore(&card->dma_lock, flags);
+
+  return;
+} /* end stats_clear */
+
+/* one read-only sysfs file per counter */
+#define TIMING_STAT_ATTR(field, fmt)					\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf) {	\
+									\
+  timing_card_data *card;						\
+  unsigned long flags;							\
+  ssize_t len;								\
+									\
+  card = dev_get_drvdata(dev);						\
+									\
+  spin_lock_irqsave(&card->dma_lock, flags);				\
+  len = scnprintf(buf, PAGE_SIZE, fmt "\n", card->stats.field);	\
+  spin_unlock_irqrestore(&card->dma_lock, flags);			\
+									\
+  return len;								\
+}									\
+static DEVICE_ATTR_RO(field)
+
+TIMING_STAT_ATTR(transfers,     "%llu");
+TIMING_STAT_ATTR(bytes,         "%llu");
+TIMING_STAT_ATTR(underruns,     "%llu");
+TIMING_STAT_ATTR(near_misses,   "%llu");
+TIMING_STAT_ATTR(stalls,        "%llu");
+TIMING_STAT_ATTR(min_margin_ns, "%lld");
+
+static struct attribute *timing_stats_attrs[] = {
+  &dev_attr_transfers.attr,
+  &dev_attr_bytes.attr,
+  &dev_attr_underruns.attr,
+  &dev_attr_near_misses.attr,
+  &dev_attr_stalls.attr,
+  &dev_attr_min_margin_ns.attr,
+  NULL
+};
+
+static const struct attribute_group timing_stats_group = {
+  .name  = "stats",
+  .attrs = timing_stats_attrs,
+};
+
+/* first of the TIMING_DEV_COUNT minors of the card's slot */
+static ssize_t minor_base_show(struct device *dev,
+			       struct device_attribute *attr, char *buf) {
+
+  timing_card_data *card;
+
+  card = dev_get_drvdata(dev);
+
+  return scnprintf(buf, PAGE_SIZE, "%d\n",
+		   FIRST_MINOR + card->index * TIMING_DEV_COUNT);
+} /* end minor_base_show */
+static DEVICE_ATTR_RO(minor_base);
+
+/*                 *****                 */
+/*             *************             */
+/*         *********************         */
+/*     *****************************     */
+/* ************************************* */
+/* ******** LATENCY HISTOGRAMS ********* */
+/* ************************************* */
+/*     *****************************     */
+/*         *********************         */
+/*             *************             */
+/*                 *****                 */
+
+/*
+   Log2 histograms, in nanoseconds, of the stages of the
+   refill timeline in readme.txt:
+
+     dma_time    transfer start to DMA done interrupt
+     wake        retire in the interrupt to kthread running
+     sleep       refill timer expiry past the time asked for
+     gap         FIFO at the low water mark to transfer start
+
+   Bucket 0 holds values under 1 ns (and negative ones),
+   bucket b values from 2^(b-1) up to 2^b, the last one
+   everything above. Each CPU counts into its own copy with
+   this_cpu_inc, no locks; reading sums them. They are under
+   <debugfs>/timing/card<n>/, and writing anything to the
+   reset file there zeroes all four.
+ */
+
+static const char *hist_names[HIST_COUNT] = {
+  [HIST_DMA_TIME] = "dma_time",
+  [HIST_WAKE]     = "wake",
+  [HIST_SLEEP]    = "sleep",
+  [HIST_GAP]      = "gap",
+};
+
+/* count ns in stage's histogram, any context */
+static void hist_add(timing_card_data *card, int stage, s64 ns) {
+
+  int b;
+
+  b = ns > 0 ? fls64(ns) : 0;
+  if ( b >= TIMING_HIST_BUCKETS )
+    b = TIMING_HIST_BUCKETS - 1;
+
+  this_cpu_inc(card->hist->bucket[stage][b]);
+
+  return;
+} /* end hist_add */
+
+/* "lower bound (ns)  count" per non-empty bucket */
+static int hist_show(struct seq_file *m, void *v) {
+
+  int cpu, b;
+  u64 count, total;
+  timing_hist_file *hf = m->private;
+
+  seq_printf(m, "%-12s %12s\n", "ns >=", "count");
+
+  for ( b = 0, total = 0; b < TIMING_HIST_BUCKETS; b++ ) {
+
+    count = 0;
+    for_each_possible_cpu(cpu)
+      count += per_cpu_ptr(hf->card->hist, cpu)->bucket[hf->stage][b];
+
+    if ( count )
+      seq_printf(m, "%-12llu %12llu\n", b ? 1ULL << (b - 1) : 0ULL, count);
+
+    total += count;
+  }
+
+  seq_printf(m, "%-12s %12llu\n", "total", total);
+
+  return 0;
+} /* end hist_show */
+
+static int hist_open(struct inode *inode, struct file *filp) {
+
+  return single_open(filp, hist_show, inode->i_private);
+} /* end hist_open */
+
+/* a counter racing with this may survive it, fine for a histogram */
+static ssize_t hist_reset_write(struct file *filp, const char __user *buf,
+				size_t count, loff_t *f_pos) {
+
+  int cpu;
+  timing_card_data *card = filp->private_data;
+
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(card->hist, cpu), 0, sizeof(timing_hist));
+
+  return count;
+} /* end hist_reset_write */
+
+static const struct file_operations hist_fops = {
+  .owner   = THIS_MODULE,
+  .open    = hist_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations hist_reset_fops = {
+  .owner   = THIS_MODULE,
+  .open    = simple_open,
+  .write   = hist_reset_write,
+  .llseek  = noop_llseek,
+};
+
+/* <debugfs>/timing/card<n>/, nothing to check: debugfs is optional */
+static void hist_debugfs_init(timing_card_data *card) {
+
+  int i;
+  char name[16];
+
+  snprintf(name, sizeof(name), "card%d", card->index);
+  card->debug_dir = debugfs_create_dir(name, timing_debug_root);
+
+  for ( i = 0; i < HIST_COUNT; i++ ) {
+    card->hist_file[i].card  = card;
+    card->hist_file[i].stage = i;
+    debugfs_create_file(hist_names[i], S_IRUGO, card->debug_dir,
+			&card->hist_file[i], &hist_fops);
+  }
+
+  debugfs_create_file("reset", S_IWUSR, card->debug_dir, card,
+		      &hist_reset_fops);
+
+  return;
+} /* end hist_debugfs_init */
+
+/*                 *****                 */
+/*             *************             */
+/*         *********************         */
+/*     *****************************     */
+/* ************************************* */
+/* *********** DI CAPTURE ************** */
+/* ************************************* */
+/*     *****************************     */
+/*         *********************         */
+/*             *************             */
+/*                 *****                 */
+
+/*
+   DMA channel 0 moves DI FIFO samples into a ring of
+   di_blocks coherent buffers, through a circular descriptor
+   chain (demand mode, local to PCI) with a terminal count
+   interrupt per block. It never ends, so the bridge keeps
+   the FIFO drained; the interrupt works out from DMADPR0
+   which block the bridge is filling and makes the ones
+   before it readable.
+
+   di_widx is the block being filled, the di_count blocks
+   before it are readable from di_ridx (di_roff bytes of
+   that one already read). When the bridge moves on to a
+   block still unread it overwrites the oldest data: that
+   block is dropped and counted as an overrun. A reader in
+   the middle of copying it may get a mix of old and new.
+
+   read() on the DI FIFO device copies from the ring while
+   capture runs or data is left; mmap() maps the ring and
+   TIMING_IOC_DI_INFO/TIMING_IOC_DI_RELEASE say what is
+   readable and hand blocks back.
+ */
+
+/* allocate the capture ring and its descriptors */
+static int di_ring_alloc(timing_card_data *card) {
+
+  int i;
+  struct pci_dev *dev = card->pdev;
+
+  /* capture is optional */
+  if ( !di_blocks )
+    return 0;
+
+  card->di_block_size = PAGE_ALIGN(di_block_kb * 1024);
+  if ( di_blocks < 2 || !card->di_block_size ||
+       card->di_block_size > DMA_CHAIN_MAX_SIZE ) {
+    printk(KERN_ALERT "timing: bad DI ring geometry %d x %d KB\n",
+	   di_blocks, di_block_kb);
+    return -EINVAL;
+  }
+
+  card->di_ring = kcalloc(di_blocks, sizeof(timing_dma_seg), GFP_KERNEL);
+  if ( !card->di_ring )
+    goto no_mem;
+
+  for ( i = 0; i < di_blocks; i++ ) {
+    card->di_ring[i].virt = pci_alloc_consistent(dev, card->di_block_size,
+						 &card->di_ring[i].bus);
+    if ( !card->di_ring[i].virt )
+      goto no_mem;
+    card->di_ring[i].len = card->di_block_size;
+    card->di_blocks++;
+  }
+
+  card->di_desc = pci_alloc_consistent(dev, di_blocks *
+				       sizeof(plx9080_dma_desc),
+				       &card->di_desc_bus);
+  if ( !card->di_desc )
+    goto no_mem;
+
+  return 0;
+
+ no_mem:
+  printk(KERN_ALERT "timing: failed to allocate DI capture ring\n");
+  di_ring_free(card);
+  return -ENOMEM;
+} /* end di_ring_alloc */
+
+static void di_ring_free(timing_card_data *card) {
+
+  struct pci_dev *dev = card->pdev;
+
+  if ( card->di_desc )
+    pci_free_consistent(dev, di_blocks * sizeof(plx9080_dma_desc),
+			card->di_desc, card->di_desc_bus);
+  card->di_desc = NULL;
+
+  while ( card->di_blocks > 0 ) {
+    card->di_blocks--;
+    pci_free_consistent(dev, card->di_block_size,
+			card->di_ring[card->di_blocks].virt,
+			card->di_ring[card->di_blocks].bus);
+  }
+
+  kfree(card->di_ring);
+  card->di_ring = NULL;
+
+  return;
+} /* end di_ring_free */
+
+/* start channel 0 on a fresh ring (di_mutex held) */
+static int di_start(timing_card_data *card) {
+
+  int i, n;
+  u32 tmp32;
+  unsigned long flags;
+  void __iomem *lcr = card->port[12].base;
+
+  n = card->di_blocks;
+  if ( !n )
+    return -ENODEV;
+  if ( card->di_running )
+    return -EBUSY;
+
+  /* one block per descriptor, the last one back to the first */
+  for ( i = 0; i < n; i++ ) {
+    card->di_desc[i].pci_addr   = cpu_to_le32(card->di_ring[i].bus);
+    card->di_desc[i].local_addr = cpu_to_le32(DI_FIFO_LADR);
+    card->di_desc[i].size       = cpu_to_le32(card->di_block_size);
+    card->di_desc[i].next = 
+      cpu_to_le32((card->di_desc_bus + ((i + 1) % n) * 
+		   sizeof(plx9080_dma_desc)) |
+		  PLX9080_DMADPR_PCI_SPACE | PLX9080_DMADPR_TC_INT |
+		  PLX9080_DMADPR_TO_PCI);
+  }
+  wmb();
+
+  spin_lock_irqsave(&card->di_lock, flags);
+  card->di_widx = 0;
+  card->di_ridx = 0;
+  card->di_count = 0;
+  card->di_roff = 0;
+  card->di_running = 1;
+  spin_unlock_irqrestore(&card->di_lock, flags);
+
+  /* enable interrupts from channel 0 */
+  tmp32 = ioread32(lcr + PLX9080_INTCSR);
+  iowrite32(tmp32 | (0x1 << 8) | (0x1 << 18), lcr + PLX9080_INTCSR);
+
+  /* clear interrupts and disable DMA */
+  iowrite8(PLX9080_DMACSR_CLEAR_INT, lcr + PLX9080_DMACSR0);
+  iowrite8(0x00,                     lcr + PLX9080_DMACSR0);
+
+  /* as channel 1, paced by the DI FIFO */
+  iowrite32(cpu_to_le32(0x00020c01 | PLX9080_DMAMODE_CHAIN |
+			PLX9080_DMAMODE_DEMAND),
+	    lcr + PLX9080_DMAMODE0);
+  iowrite32(cpu_to_le32(card->di_desc_bus | PLX9080_DMADPR_PCI_SPACE |
+			PLX9080_DMADPR_TO_PCI),
+	    lcr + PLX9080_DMADPR0);
+
+  /* Enable and start DMA */
+  iowrite8(PLX9080_DMACSR_ENABLE, lcr + PLX9080_DMACSR0);
+  iowrite8(PLX9080_DMACSR_ENABLE | PLX9080_DMACSR_START,
+	   lcr + PLX9080_DMACSR0);
+
+  return 0;
+} /* end di_start */
+
+/* stop channel 0; what was captured stays readable (di_mutex held) */
+static void di_stop(timing_card_data *card) {
+
+  int i;
+  unsigned long flags;
+  void __iomem *lcr = card->port[12].base;
+
+  if ( !card->di_running )
+    return;
+
+  spin_lock_irqsave(&card->di_lock, flags);
+  card->di_running = 0;
+  spin_unlock_irqrestore(&card->di_lock, flags);
+
+  /* the chain never ends by itself */
+  iowrite8(0x00, lcr + PLX9080_DMACSR0);
+  iowrite8(PLX9080_DMACSR_ABORT, lcr + PLX9080_DMACSR0);
+  for ( i = 0; i < 1000; i++ ) {
+    if ( ioread8(lcr + PLX9080_DMACSR0) & PLX9080_DMACSR_DONE )
+      break;
+    udelay(1);
+  }
+  iowrite8(PLX9080_DMACSR_CLEAR_INT, lcr + PLX9080_DMACSR0);
+
+  /* readers waiting for more get the end of the data */
+  wake_up_interruptible(&card->di_wait);
+
+  return;
+} /* end di_stop */
+
+/* channel 0 finished a block or more */
+static void di_interrupt(timing_card_data *card) {
+
+  int n, cur;
+  u32 next;
+  void __iomem *lcr = card->port[12].base;
+
+  iowrite8(PLX9080_DMACSR_ENABLE | PLX9080_DMACSR_CLEAR_INT,
+	   lcr + PLX9080_DMACSR0);
+
+  spin_lock(&card->di_lock);
+
+  if ( !card->di_running ) {
+    spin_unlock(&card->di_lock);
+    return;
+  }
+
+  /* DMADPR0 points at the descriptor after the one in use */
+  n = card->di_blocks;
+  next = ((ioread32(lcr + PLX9080_DMADPR0) & ~0xf) - card->di_desc_bus) /
+    sizeof(plx9080_dma_desc);
+  if ( next >= n ) {
+    spin_unlock(&card->di_lock);
+    return;
+  }
+  cur = (next + n - 1) % n;
+
+  while ( card->di_widx != cur ) {
+
+    card->di_widx = (card->di_widx + 1) % n;
+    card->di_bytes += card->di_block_size;
+
+    /* the bridge is now filling the oldest unread block */
+    if ( card->di_count == n - 1 ) {
+      card->di_ridx = (card->di_ridx + 1) % n;
+      card->di_roff = 0;
+      card->di_overruns++;
+      card->di_overrun_bytes += card->di_block_size;
+    }
+    else
+      card->di_count++;
+  }
+
+  spin_unlock(&card->di_lock);
+
+  wake_up_interruptible(&card->di_wait);
+
+  return;
+} /* end di_interrupt */
+
+/* is read() on the DI FIFO a stream rather than a register */
+static int di_active(timing_card_data *card) {
+
+  return READ_ONCE(card->di_running) || READ_ONCE(card->di_count);
+} /* end di_active */
+
+/* copy captured samples out, waiting for the first unless O_NONBLOCK */
+static ssize_t di_read(timing_card_data *card, struct file *filp,
+		       char __user *buf, size_t count) {
+
+  int rc, blk;
+  size_t done, len, off;
+  unsigned long flags;
+
+  if ( mutex_lock_interruptible(&card->di_mutex) )
+    return -ERESTARTSYS;
+
+  /* something to read, or the end of the capture */
+  while ( !READ_ONCE(card->di_count) && card->di_running ) {
+
+    mutex_unlock(&card->di_mutex);
+
+    if ( filp->f_flags & O_NONBLOCK )
+      return -EAGAIN;
+
+    rc = wait_event_interruptible(card->di_wait,
+				  READ_ONCE(card->di_count) ||
+				  !READ_ONCE(card->di_running));
+    if ( rc )
+      return rc;
+
+    if ( mutex_lock_interruptible(&card->di_mutex) )
+      return -ERESTARTSYS;
+  }
+
+  for ( done = 0; done < count; done += len ) {
+
+    spin_lock_irqsave(&card->di_lock, flags);
+    blk = card->di_ridx;
+    off = card->di_roff;
+    len = card->di_count ? MIN(count - done, card->di_block_size - off) : 0;
+    spin_unlock_irqrestore(&card->di_lock, flags);
+
+    if ( !len )
+      break;
+
+    if ( copy_to_user(buf + done, card->di_ring[blk].virt + off, len) ) {
+      mutex_unlock(&card->di_mutex);
+      return done ? done : -EFAULT;
+    }
+
+    /* unless the block was dropped under us, move on */
+    spin_lock_irqsave(&card->di_lock, flags);
+    if ( card->di_ridx == blk && card->di_roff == off ) {
+      card->di_roff += len;
+      if ( card->di_roff == card->di_block_size ) {
+	card->di_ridx = (card->di_ridx + 1) % card->di_blocks;
+	card->di_roff = 0;
+	card->di_count--;
+      }
+    }
+    spin_unlock_irqrestore(&card->di_lock, flags);
+  }
+
+  mutex_unlock(&card->di_mutex);
+
+  return done;
+} /* end di_read */
+
+/* user space is done with blocks it read through mmap (di_mutex held) */
+static void di_release(timing_card_data *card, u32 blocks) {
+
+  unsigned long flags;
+
+  spin_lock_irqsave(&card->di_lock, flags);
+
+  blocks = MIN(blocks, (u32)card->di_count);
+  if ( blocks ) {
+    card->di_ridx = (card->di_ridx + blocks) % card->di_blocks;
+    card->di_roff = 0;
+    card->di_count -= blocks;
+  }
+
+  spin_unlock_irqrestore(&card->di_lock, flags);
+
+  return;
+} /* end di_release */
+
+static void di_info(timing_card_data *card, struct timing_di_info *info) {
+
+  unsigned long flags;
+
+  memset(info, 0, sizeof(*info));
+
+  spin_lock_irqsave(&card->di_lock, flags);
+  info->block_size    = card->di_block_size;
+  info->block_count   = card->di_blocks;
+  info->read_block    = card->di_ridx;
+  info->read_offset   = card->di_roff;
+  info->available     = card->di_count;
+  info->running       = card->di_running;
+  info->bytes         = card->di_bytes;
+  info->overruns      = card->di_overruns;
+  info->overrun_bytes = card->di_overrun_bytes;
+  spin_unlock_irqrestore(&card->di_lock, flags);
+
+  return;
+} /* end di_info */
+
+/*                 *****                 */
+/*             *************             */
+/*         *********************         */
+/*     *****************************     */
+/* ************************************* */
+/* ********* WAVEFORM CACHE ************ */
+/* ************************************* */
+/*     *****************************     */
+/*         *********************         */
+/*             *************             */
+/*                 *****                 */
+
+/*
+   Sequences loaded once into coherent buffers of their own
+   and queued by id as often as wanted: the queue slot just
+   points its segments at the wave's buffers, as SUBMIT does
+   with the pool. card->waves is kept least recently played
+   first, which is the order waves are evicted in to stay
+   under wave_cache_kb. The cache is under dma_mutex, like
+   the queue slots that hold its waves.
+ */
+
+/* cached wave with id, or NULL (dma_mutex held) */
+static timing_wave *wave_find(timing_card_data *card, u32 id) {
+
+  timing_wave *wave;
+
+  list_for_each_entry(wave, &card->waves, lru)
+    if ( wave->id == id )
+      return wave;
+
+  return NULL;
+} /* end wave_find */
+
+/*
+   What a wave costs under the cap: every buffer is a whole
+   pool sized coherent allocation, however little of it the
+   wave uses.
+ */
+static size_t wave_charge(timing_card_data *card, timing_wave *wave) {
+
+  return (size_t)wave->buf_count * card->dma_pool_buf_size;
+} /* end wave_charge */
+
+/* free the buffers of a wave not (or no longer) on the list */
+static void wave_destroy(timing_card_data *card, timing_wave *wave) {
+
+  int i;
+
+  for ( i = 0; i < wave->buf_count; i++ )
+    if ( wave->bufs[i].virt )
+      pci_free_consistent(card->pdev, wave->bufs[i].len,
+			  wave->bufs[i].virt, wave->bufs[i].bus);
+
+  kfree(wave->bufs);
+  kfree(wave);
+
+  return;
+} /* end wave_destroy */
+
+/* take an idle wave out of the cache and free it (dma_mutex held) */
+static void wave_remove(timing_card_data *card, timing_wave *wave) {
+
+  list_del(&wave->lru);
+  card->wave_bytes -= wave_charge(card, wave);
+  wave_destroy(card, wave);
+
+  return;
+} /* end wave_remove */
+
+/*
+   Evict idle waves, least recently played first, until bytes
+   more fit under the cap (dma_mutex held). -ENOSPC if the
+   waves in use leave too little.
+ */
+static int wave_make_room(timing_card_data *card, size_t bytes) {
+
+  size_t cap;
+  timing_wave *wave, *tmp;
+
+  cap = (size_t)max(wave_cache_kb, 0) * 1024;
+  if ( bytes > cap )
+    return -EFBIG;
+
+  list_for_each_entry_safe(wave, tmp, &card->waves, lru) {
+
+    if ( card->wave_bytes + bytes <= cap )
+      break;
+
+    if ( !wave->users )
+      wave_remove(card, wave);
+  }
+
+  return card->wave_bytes + bytes <= cap ? 0 : -ENOSPC;
+} /* end wave_make_room */
+
+/*
+   TIMING_IOC_WAVE_LOAD. Room is reserved under the cap
+   first, then the buffers are allocated and filled without
+   holding up the queue, and the wave goes on the list as
+   the most recently played.
+ */
+static int wave_load(timing_card_data *card, struct timing_wave_load *wl) {
+
+  int i, rc;
+  size_t offset, block;
+  timing_wave *wave;
+  const char __user *data;
+
+  if ( !wl->length || !IS_ALIGNED(wl->length, 4) )
+    return -EINVAL;
+
+  /* played like a SUBMIT, a segment per buffer */
+  if ( wl->length > card->dma_seg_max * card->dma_pool_buf_size )
+    return -EFBIG;
+
+  wave = kzalloc(sizeof(*wave), GFP_KERNEL);
+  if ( !wave )
+    return -ENOMEM;
+
+  wave->bytes = wl->length;
+  wave->buf_count = DIV_ROUND_UP(wave->bytes, card->dma_pool_buf_size);
+  wave->bufs = kcalloc(wave->buf_count, sizeof(timing_dma_seg), GFP_KERNEL);
+  if ( !wave->bufs ) {
+    kfree(wave);
+    return -ENOMEM;
+  }
+  strscpy(wave->name, wl->name, sizeof(wave->name));
+
+  mutex_lock(&card->dma_mutex);
+  rc = wave_make_room(card, wave_charge(card, wave));
+  if ( !rc )
+    card->wave_bytes += wave_charge(card, wave);
+  mutex_unlock(&card->dma_mutex);
+
+  if ( rc ) {
+    wave_destroy(card, wave);
+    return rc;
+  }
+
+  data = u64_to_user_ptr(wl->data);
+
+  for ( i = 0, offset = 0; i < wave->buf_count; i++, offset += block ) {
+
+    block = MIN(wave->bytes - offset, card->dma_pool_buf_size);
+
+    wave->bufs[i].len  = card->dma_pool_buf_size;
+    wave->bufs[i].virt = pci_alloc_consistent(card->pdev, wave->bufs[i].len,
+					      &wave->bufs[i].bus);
+    rc = -ENOMEM;
+    if ( !wave->bufs[i].virt )
+      break;
+
+    rc = -EFAULT;
+    if ( copy_from_user(wave->bufs[i].virt, data + offset, block) )
+      break;
+
+    rc = 0;
+  }
+
+  mutex_lock(&card->dma_mutex);
+
+  if ( rc )
+    card->wave_bytes -= wave_charge(card, wave);
+  else {
+    wave->id = card->wave_next_id++;
+    if ( !card->wave_next_id )
+      card->wave_next_id = 1;
+    list_add_tail(&wave->lru, &card->waves);
+    wl->id = wave->id;
+  }
+
+  mutex_unlock(&card->dma_mutex);
+
+  if ( rc )
+    wave_destroy(card, wave);
+
+  return rc;
+} /* end wave_load */
+
+/* TIMING_IOC_WAVE_EVICT */
+static int wave_evict(timing_card_data *card, u32 id) {
+
+  int rc;
+  timing_wave *wave;
+
+  mutex_lock(&card->dma_mutex);
+
+  wave = wave_find(card, id);
+  if ( !wave )
+    rc = -ENOENT;
+  else if ( wave->users )
+    rc = -EBUSY;
+  else {
+    wave_remove(card, wave);
+    rc = 0;
+  }
+
+  mutex_unlock(&card->dma_mutex);
+
+  return rc;
+} /* end wave_evict */
+
+/* TIMING_IOC_WAVE_LIST, up to wl->count entries LRU first */
+static int wave_list(timing_card_data *card, struct timing_wave_list *wl) {
+
+  int rc;
+  u32 n;
+  timing_wave *wave;
+  struct timing_wave_info info;
+  struct timing_wave_info __user *out;
+
+  out = u64_to_user_ptr(wl->waves);
+  rc = 0;
+  n = 0;
+
+  mutex_lock(&card->dma_mutex);
+
+  list_for_each_entry(wave, &card->waves, lru) {
+
+    if ( n < wl->count ) {
+
+      memset(&info, 0, sizeof(info));
+      info.id     = wave->id;
+      info.length = wave->bytes;
+      info.users  = wave->users;
+      memcpy(info.name, wave->name, sizeof(info.name));
+
+      if ( copy_to_user(&out[n], &info, sizeof(info)) ) {
+	rc = -EFAULT;
+	break;
+      }
+    }
+
+    n++;
+  }
+
+  wl->total = n;
+  wl->bytes = card->wave_bytes;
+  wl->cap   = (u64)max(wave_cache_kb, 0) * 1024;
+
+  mutex_unlock(&card->dma_mutex);
+
+  return rc;
+} /* end wave_list */
+
+/* the stream is stopped, nothing plays a wave any more */
+static void wave_cache_free(timing_card_data *card) {
+
+  timing_wave *wave, *tmp;
+
+  list_for_each_entry_safe(wave, tmp, &card->waves, lru)
+    wave_remove(card, wave);
+
+  return;
+} /* end wave_cache_free */
+
+/*
+   TIMING_IOC_WAVE_PLAY: queue a cached wave behind whatever
+   is playing, as SUBMIT queues a region of the pool. The
+   wave stays in the cache while the slot holds it.
+ */
+static int dma_submit_wave(timing_card_data *card, struct file *filp,
+			   u32 id) {
+
+  int i, rc;
+  size_t left, block;
+  timing_seq *seq;
+  timing_wave *wave;
+
+  mutex_lock(&card->dma_mutex);
+
+  /* not while the FIFO replays a pattern by itself, nor */
+  /* once remove has stopped the stream for good          */
+  rc = card->gone ? -ENODEV : dma_pattern_busy(card);
+
+  while ( !rc ) {
+
+    /* could have been evicted while we slept */
+    wave = wave_find(card, id);
+    rc = -ENOENT;
+    if ( !wave )
+      break;
+
+    seq = dma_seq_get(card);
+    rc = 0;
+    if ( seq )
+      break;
+
+    rc = dma_queue_wait(card, filp->f_flags & O_NONBLOCK);
+    if ( rc )
+      break;
+  }
+
+  if ( !rc ) {
+
+    /* never fails, a wave has no more buffers than segments */
+    for ( i = 0, left = wave->bytes; left > 0; i++, left -= block ) {
+      block = MIN(left, wave->bufs[i].len);
+      dma_seg_add(card, seq, wave->bufs[i].virt, wave->bufs[i].bus, block);
+    }
+
+    seq->wave = wave;
+    wave->users++;
+    list_move_tail(&wave->lru, &card->waves);
+
+    seq->bytes = wave->bytes;
+    if ( dma_chain )
+      dma_chain_build(card, seq);
+    dma_queue_submit(card, seq);
+  }
+
+  mutex_unlock(&card->dma_mutex);
+
+  return rc;
+} /* end dma_submit_wave */
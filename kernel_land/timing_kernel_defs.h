@@ -14,6 +14,19 @@
 
 #include <linux/cdev.h>
 #include <linux/pci.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/seq_file.h>
+#include <linux/list.h>
+#include <linux/kobject.h>
+#include <linux/rwsem.h>
+#include "timing_ioctl.h"
 
 /*
   Vendor and device ID used by the PCI protocol
@@ -42,6 +55,11 @@
 /* for the Registration of the driver */
 #define FIRST_MINOR      0
 
+/* cards handled by one module, each gets  */
+/* TIMING_DEV_COUNT minors starting at     */
+/* FIRST_MINOR + card * TIMING_DEV_COUNT   */
+#define TIMING_MAX_CARDS 8
+
 /* 9 char drivers... one for each of the */
 /* 8 IO Ports on the card, and one for   */
 /* access to the Bus Master   LCR (local */
@@ -78,6 +96,105 @@
 #define TIMER8254_ID  8
 #define PCI7300_ID    7
 
+/*
+  Local bus address of the DO FIFO port as seen by
+  the PLX9080 DMA engine (BAR 2 offset 0x14)
+ */
+#define DO_FIFO_LADR 0x14
+
+/* ... and of the DI FIFO port (BAR 2 offset 0x10) */
+#define DI_FIFO_LADR 0x10
+
+/* DO_CSR bits, as in do_csr.h */
+#define DO_CSR_PAT_GEN    0x00000010
+#define DO_CSR_ENABLE     0x00000100
+#define DO_CSR_CLEAR_FIFO 0x00000200
+#define DO_CSR_UNDERRUN   0x00000400
+#define DO_CSR_FULL       0x00000800
+#define DO_CSR_EMPTY      0x00001000
+
+/* 8254 read-back: latch count and status of counters 0-2 */
+#define READBACK_8254_ALL 0xce
+
+/*
+  PLX9080 chained DMA descriptor. The bridge fetches
+  these from PCI memory when DMAMODE chaining is set,
+  so the block must be quad word (16 byte) aligned and
+  little endian. The low bits of 'next' carry the
+  PLX9080_DMADPR_* flags for the following block.
+ */
+typedef struct _plx9080_dma_desc {
+
+  __le32 pci_addr;                /* PCI (host) bus address */
+  __le32 local_addr;              /* local bus address      */
+  __le32 size;                    /* transfer size in bytes */
+  __le32 next;                    /* next descriptor + bits */
+
+} __attribute__((aligned(16))) plx9080_dma_desc;
+
+/*
+  One contiguous block of DMA-able memory. Used both for
+  the persistent pool buffers and for the segments that
+  make up the sequence currently being sent.
+ */
+typedef struct _timing_dma_seg {
+
+  void       *virt;               /* kernel address         */
+  dma_addr_t  bus;                /* bus address for PLX    */
+  size_t      len;                /* bytes in this block    */
+
+} timing_dma_seg;
+
+/*
+  State of the adaptive refill controller. Rates are
+  in picoseconds per byte, levels in FIFO words.
+ */
+typedef struct _timing_refill_ctl {
+
+  u64 ewma_ps_per_byte;           /* smoothed DMA cost      */
+  u64 worst_ps_per_byte;          /* decaying worst case    */
+  u32 samples;                    /* transfers measured     */
+  u64 level_words;                /* FIFO level at level_ns */
+  s64 level_ns;                   /* when it was that level */
+  u64 start_words;                /* level at xfer start    */
+  u64 low_words;                  /* low water mark in use  */
+  s64 due_ns;                     /* next refill timer time */
+  int due_set;                    /* ... armed for next kick */
+  size_t next_bytes;              /* size of next refill    */
+
+} timing_refill_ctl;
+
+/*
+  Latency histograms of the refill pipeline, log2 buckets
+  of nanoseconds, one copy per CPU.
+ */
+#define HIST_DMA_TIME  0                /* DMA start to done      */
+#define HIST_WAKE      1                /* IRQ to kthread running */
+#define HIST_SLEEP     2                /* refill timer lateness  */
+#define HIST_GAP       3                /* low mark to DMA start  */
+#define HIST_COUNT     4
+#define TIMING_HIST_BUCKETS 40
+
+typedef struct _timing_hist {
+
+  u64 bucket[HIST_COUNT][TIMING_HIST_BUCKETS];
+
+} timing_hist;
+
+/* what a histogram file in debugfs shows */
+typedef struct _timing_hist_file {
+
+  struct _timing_card_data *card;
+  int stage;
+
+} timing_hist_file;
+
+/* smallest refill the controller will plan, in words */
+#define REFILL_MIN_WORDS 1024
+
+/* DMASIZ is 23 bits wide; keep each block well under */
+#define DMA_CHAIN_MAX_SIZE (4 * 1024 * 1024)
+
 /* ioctl commands  -- note: not picked carfully */
 #define CHANGE_PLX_OFFSET 0x34d0 /* arbitrary identifier */
 
@@ -95,9 +212,165 @@ typedef struct _sdarn_timing_driver_data {
   dev_t num;                      /* device number */
   int component;                  /* component     */
   unsigned int offset;            /* offset from base (for PLX9080) */
+  struct _timing_card_data *card; /* card this port is on */
 
 } timing_dev_data;
 
+/*
+  A sequence kept in driver memory to be played by id.
+  Blocks are pool sized coherent buffers; a wave can't be
+  evicted while a queued sequence plays it.
+ */
+typedef struct _timing_wave {
+
+  struct list_head lru;           /* least recently played  */
+  u32 id;                         /*   first on card->waves */
+  char name[TIMING_WAVE_NAME_LEN];
+  size_t bytes;
+  timing_dma_seg *bufs;
+  int buf_count;
+  int users;                      /* queue slots playing it */
+
+} timing_wave;
+
+/* most sequences queued on one card (queue_depth) */
+#define TIMING_QUEUE_MAX 16
+
+/* a sync O_DIRECT write asleep until its pages are let go */
+typedef struct _timing_sync {
+  struct completion done;
+  long result;                    /* 0 or -ECANCELED        */
+} timing_sync;
+
+/*
+  One sequence queued on the DO FIFO: the blocks it is made
+  of, how it is played, and what it holds (pool buffers or
+  pinned user pages) until the stream is done with it.
+ */
+typedef struct _timing_seq {
+
+  timing_dma_seg *segs;           /* blocks making it up    */
+  int seg_count;
+  size_t bytes;                   /* length of one cycle    */
+  u32 cycles;                     /* times to play, 0 = loop */
+  u32 cycles_done;                /* completed so far       */
+  u32 num;                        /* position in the queue  */
+  struct kiocb *iocb;             /* async writer, if any   */
+  timing_sync *sync;              /* sync O_DIRECT writer   */
+  long result;                    /* error to complete with */
+
+  /* run-length sequence, expanded as it is sent */
+  struct timing_run *runs;
+  u32 run_count;
+
+  timing_wave *wave;              /* cached one it plays    */
+
+  /* chain descriptors, two copies of the segment list */
+  plx9080_dma_desc *desc;
+  dma_addr_t desc_bus;
+  int rings;                      /* copies in use          */
+  int end_link[2];                /* copy ends in next seq  */
+
+  unsigned long *bufs;            /* pool buffers it reads  */
+
+  /* user pages pinned for a zero-copy (O_DIRECT) write */
+  struct page **pages;
+  int page_count, sg_mapped;
+  struct sg_table sgt;
+
+} timing_seq;
+
+/*
+  Everything belonging to one PCIe-7300A: its char devices,
+  interrupt, and the DO stream with its DMA pool and refill
+  engine. One is allocated per probe, so cards stream
+  independently of each other.
+ */
+typedef struct _timing_card_data {
+
+  timing_dev_data port[TIMING_DEV_COUNT]; /* char devices   */
+  timing_dev_data *master_chip;   /* port for the PLX LCR   */
+  struct pci_dev *pdev;           /* kernel PCI device      */
+  int index;                      /* slot in timing_cards   */
+  struct kobject kobj;            /* files, maps and probe  */
+  struct rw_semaphore gone_sem;   /* file ops vs remove     */
+  int gone;                       /* removed, ops fail      */
+  u8  irq_line;                   /* assigned interrupt     */
+
+  /* DO stream */
+  u64 ns_clock_period;            /* DO clock period        */
+  int fifo_width;                 /* bytes per FIFO word    */
+  dma_addr_t dma_bus_addr;        /* current transfer       */
+  size_t dma_size, total_size;    /* its size, bytes left   */
+  struct task_struct *dma_kthread;
+  u64 dma_delay;                  /* Wt' for next refill    */
+  int output_enabled, dma_waiting, dma_configured;
+  int dma_running;
+  struct hrtimer refill_timer;    /* starts refills         */
+  struct hrtimer start_timer;     /* scheduled output start */
+  u32 start_csr;                  /* DO_CSR written then    */
+  int start_di;                   /* ... DI_CSR first       */
+  u32 start_di_csr;
+  s64 output_start_ns;            /* last start, monotonic  */
+  s64 start_late_ns;              /* how late it was        */
+  struct timing_stats stats;      /* DO stream counters     */
+  u32 csr_status;                 /* last DO_CSR flags seen */
+
+  /* latency histograms */
+  timing_hist __percpu *hist;
+  s64 wake_ns;                    /* kthread woken, not run */
+  struct dentry *debug_dir;
+  timing_hist_file hist_file[HIST_COUNT];
+
+  /* DI capture ring on DMA channel 0 */
+  timing_dma_seg *di_ring;
+  int di_blocks;
+  size_t di_block_size;
+  plx9080_dma_desc *di_desc;      /* circular chain         */
+  dma_addr_t di_desc_bus;
+  spinlock_t di_lock;             /* IRQ/reader ring state  */
+  struct mutex di_mutex;          /* one reader at a time   */
+  wait_queue_head_t di_wait;      /* readers wait for data  */
+  int di_running;
+  int di_widx, di_ridx, di_count; /* filling, oldest, ready */
+  size_t di_roff;                 /* read into di_ridx      */
+  u64 di_bytes, di_overruns, di_overrun_bytes;
+  spinlock_t dma_lock;            /* IRQ/timer/process      */
+  s64 start_ns, end_ns;           /* last transfer times    */
+  timing_refill_ctl refill;       /* adaptive refill state  */
+  struct mutex dma_mutex;         /* serializes submitters  */
+  struct mutex reg_mutex;         /* register writers       */
+  u32 cycles;                     /* for the next sequence  */
+
+  /* persistent DMA pool */
+  timing_dma_seg *dma_pool;
+  int dma_pool_count;
+  size_t dma_pool_buf_size;
+  int *dma_pool_users;            /* sequences per buffer   */
+  atomic_t pool_maps;             /* live mmaps of the pool */
+  timing_dma_seg rle_buf;         /* refills of runs        */
+
+  /* waveform cache (dma_mutex) */
+  struct list_head waves;
+  size_t wave_bytes;              /* memory cached waves use */
+  u32 wave_next_id;
+
+  /* sequence queue; [q_reap, q_head) are done and wait for */
+  /* the kthread, [q_head, q_tail) are queued and q_head is */
+  /* playing. Free running, slot is count % queue_len.      */
+  timing_seq seq[TIMING_QUEUE_MAX];
+  int queue_len;
+  u32 q_reap, q_head, q_tail;
+  wait_queue_head_t queue_wait;   /* writers, poll          */
+  int pool_want;                  /* buffers an EAGAIN wants */
+
+  /* refill engine position in the head sequence, */
+  /* segment and offset, or run and word in it     */
+  int dma_seg_max, dma_seg_idx;
+  size_t dma_seg_off;
+
+} timing_card_data;
+
 /* module init and exit functions */
 static int  __init timing_dev_init(void);
 static void __exit timing_dev_exit(void);
@@ -113,7 +386,147 @@ static int timing_dev_open(struct inode *inode,
 static int timing_dev_release(struct inode *inode,
 			      struct file  *filp );
 
-void configure_for_dma(void);
+/* card lifetime, file ops while it is removed */
+static void timing_card_release(struct kobject *kobj);
+static struct kobj_type timing_card_ktype;
+static int  timing_enter(timing_card_data *card);
+static void timing_leave(timing_card_data *card);
+static timing_card_data *timing_file_card(struct file *filp);
+static ssize_t timing_live_read(struct file *filp, char __user *buf,
+				size_t count, loff_t *f_pos);
+static ssize_t timing_live_write(struct file *filp, const char __user *buf,
+				 size_t count, loff_t *f_pos);
+static ssize_t timing_live_write_iter(struct kiocb *iocb,
+				      struct iov_iter *from);
+static long timing_live_ioctl(struct file *filp, unsigned int cmd,
+			      unsigned long arg);
+static int  timing_live_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t timing_live_poll(struct file *filp, poll_table *wait);
+
+void configure_for_dma(timing_card_data *card);
+static int  timing_start_at(timing_card_data *card,
+			    struct timing_start_at *sa, int di, u32 di_csr);
+static enum hrtimer_restart start_timer_fn(struct hrtimer *timer);
+static void timing_output_start(timing_card_data *card);
+static int  timing_duplex_start(timing_card_data *card,
+				struct timing_duplex *dx);
+static int  timing_pattern_load(timing_card_data *card,
+				struct timing_pattern *pat);
+static int  dma_pattern_busy(timing_card_data *card);
+
+static void stats_sample(timing_card_data *card, size_t bytes);
+static void stats_margin(timing_card_data *card);
+static void stats_clear(timing_card_data *card);
+static const struct attribute_group timing_stats_group;
+static struct device_attribute dev_attr_minor_base;
+
+static int  timing_bar_mmap(timing_card_data *card, int bar,
+			    struct vm_area_struct *vma);
+static int  reg_op_check(timing_card_data *card, struct timing_reg_op *op);
+static int  timing_reg_batch(timing_card_data *card,
+			     struct timing_reg_batch *batch);
+static void timing_status_snapshot(timing_card_data *card,
+				   struct timing_status *st);
+
+static timing_wave *wave_find(timing_card_data *card, u32 id);
+static void wave_destroy(timing_card_data *card, timing_wave *wave);
+static size_t wave_charge(timing_card_data *card, timing_wave *wave);
+static void wave_remove(timing_card_data *card, timing_wave *wave);
+static int  wave_make_room(timing_card_data *card, size_t bytes);
+static int  wave_load(timing_card_data *card, struct timing_wave_load *wl);
+static int  wave_evict(timing_card_data *card, u32 id);
+static int  wave_list(timing_card_data *card, struct timing_wave_list *wl);
+static void wave_cache_free(timing_card_data *card);
+static int  dma_submit_wave(timing_card_data *card, struct file *filp,
+			    u32 id);
+
+static int  di_ring_alloc(timing_card_data *card);
+static void di_ring_free(timing_card_data *card);
+static int  di_start(timing_card_data *card);
+static void di_stop(timing_card_data *card);
+static void di_interrupt(timing_card_data *card);
+static int  di_active(timing_card_data *card);
+static ssize_t di_read(timing_card_data *card, struct file *filp,
+		       char __user *buf, size_t count);
+static void di_release(timing_card_data *card, u32 blocks);
+static void di_info(timing_card_data *card, struct timing_di_info *info);
+
+static void hist_add(timing_card_data *card, int stage, s64 ns);
+static int  hist_show(struct seq_file *m, void *v);
+static int  hist_open(struct inode *inode, struct file *filp);
+static ssize_t hist_reset_write(struct file *filp, const char __user *buf,
+				size_t count, loff_t *f_pos);
+static void hist_debugfs_init(timing_card_data *card);
+
+static u64  refill_level_at(timing_card_data *card, s64 now_ns);
+static void refill_mark_start(timing_card_data *card, s64 now_ns);
+static void refill_update(timing_card_data *card, size_t bytes, s64 tt_ns);
+static void refill_plan(timing_card_data *card);
+static void refill_arm(timing_card_data *card, s64 base_ns);
+static enum hrtimer_restart refill_timer_fn(struct hrtimer *timer);
+static void dma_refill_kick(timing_card_data *card);
+
+static int  dma_pool_alloc(timing_card_data *card);
+static void dma_pool_free(timing_card_data *card);
+static int  dma_pool_fill(timing_card_data *card, timing_seq *seq,
+			  struct iov_iter *iter, size_t count);
+static int  dma_pool_room(timing_card_data *card, size_t count);
+static int  dma_pool_idle(timing_card_data *card);
+static int  dma_pool_fill_rle(timing_card_data *card, timing_seq *seq,
+			      struct timing_run *runs, u32 run_count,
+			      size_t count);
+static size_t rle_expand(const struct timing_run *runs, u32 count,
+			 int *idx, size_t *off, u32 *dst, size_t words);
+static int  dma_pool_segs(timing_card_data *card, timing_seq *seq,
+			  size_t offset, size_t count);
+static void dma_pool_hold(timing_card_data *card, timing_seq *seq, int i);
+static void timing_vm_open(struct vm_area_struct *vma);
+static void timing_vm_close(struct vm_area_struct *vma);
+static void dma_pool_vm_open(struct vm_area_struct *vma);
+static void dma_pool_vm_close(struct vm_area_struct *vma);
+static int  dma_pool_mmap(timing_card_data *card,
+			  struct vm_area_struct *vma);
+static int  dma_segs_mmap(timing_card_data *card, timing_dma_seg *segs,
+			  int count, size_t size,
+			  struct vm_area_struct *vma);
+static int  dma_seg_remap(timing_card_data *card, timing_dma_seg *seg,
+			  size_t size, size_t in_buf, size_t block,
+			  struct vm_area_struct *vma, unsigned long addr);
+static size_t dma_next_chunk(timing_card_data *card, size_t max);
+static int  dma_seg_add(timing_card_data *card, timing_seq *seq,
+			void *virt, dma_addr_t bus, size_t len);
+static int  dma_user_pin(timing_card_data *card, timing_seq *seq,
+			 const char __user *buf, size_t count);
+static void dma_user_unpin(timing_card_data *card, timing_seq *seq);
+static void dma_abort(timing_card_data *card);
+static void dma_chain_build(timing_card_data *card, timing_seq *seq);
+static void dma_chain_start(timing_card_data *card, timing_seq *seq);
+static dma_addr_t dma_chain_desc_bus(timing_seq *seq, int idx);
+static int  dma_chain_on(timing_card_data *card, timing_seq *seq);
+static void dma_chain_set_end(timing_card_data *card, timing_seq *seq,
+			      int ring);
+static void dma_chain_splice(timing_card_data *card, timing_seq *seq);
+static void dma_chain_cycle(timing_card_data *card);
+static void dma_chain_done(timing_card_data *card);
+static int  dma_next_cycle(timing_card_data *card);
+static void dma_refill_start(timing_card_data *card);
+static void dma_stop_stream(timing_card_data *card);
+
+static int  dma_submit(timing_card_data *card, struct file *filp,
+		       struct kiocb *iocb, struct iov_iter *iter,
+		       size_t offset, size_t count);
+static int  dma_submit_rle(timing_card_data *card, struct file *filp,
+			   struct timing_rle *rle);
+static timing_seq *dma_seq_at(timing_card_data *card, u32 n);
+static timing_seq *dma_seq_get(timing_card_data *card);
+static timing_seq *dma_loop_tail(timing_card_data *card);
+static int  dma_can_accept(timing_card_data *card, int need);
+static int  dma_queue_wait(timing_card_data *card, int nowait);
+static void dma_queue_submit(timing_card_data *card, timing_seq *seq);
+static timing_seq *dma_seq_retire(timing_card_data *card);
+static void dma_queue_reap(timing_card_data *card);
+static void dma_seq_cursor(timing_card_data *card, timing_seq *seq);
+static void dma_seq_release(timing_card_data *card, timing_seq *seq);
 
 int dma_init_kthread(void *data);
 static ssize_t dma_transfer(struct file *filp, const char __user *buf,
@@ -123,10 +536,14 @@ static ssize_t timing_read(struct file *filp, char __user *buf,
 			   size_t count, loff_t *f_pos);
 static ssize_t timing_write(struct file *filp, const char __user *buf,
 			    size_t count, loff_t *f_pos);
+static ssize_t timing_write_iter(struct kiocb *iocb, struct iov_iter *from);
 
 static ssize_t chip_8254_write(struct file *filp, const char __user *buf,
 			       size_t count, loff_t *f_pos);
+static void timing_reg_write(timing_dev_data *dev, u32 value);
 
 long timing_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int timing_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t timing_poll(struct file *filp, poll_table *wait);
 
 #endif
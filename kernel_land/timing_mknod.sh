@@ -18,10 +18,26 @@ sudo rm -f /dev/${device}*
 # must find dynamically assigned Major number
 major=$(cat /proc/devices | grep -m 1 "timing" | cut -d ' ' -f 1)
 
-# make nodes
-i=0
-while [ $i -lt 13 ]
+# let the probes and their sysfs entries settle
+if command -v udevadm > /dev/null
+then
+    sudo udevadm settle
+fi
+
+# every card probed gets 13 consecutive minors from the
+#      first free slot, its minor_base in sysfs; card slot 0
+#      keeps /dev/timing0 .. /dev/timing12 (bound devices are
+#      named domain:bus:slot.fn, the domain need not be 0000)
+for dev in /sys/bus/pci/drivers/$module/*:*
 do
-    sudo mknod -m 666 /dev/${device}$i c $major $i
-    i=$(($i + 1))
+    [ -r $dev/minor_base ] || continue
+    base=$(cat $dev/minor_base)
+
+    # make nodes
+    i=$base
+    while [ $i -lt $(($base + 13)) ]
+    do
+	sudo mknod -m 666 /dev/${device}$i c $major $i
+	i=$(($i + 1))
+    done
 done
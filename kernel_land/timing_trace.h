@@ -0,0 +1,169 @@
+/*
+  Tracepoints for the DO stream. They cost a patched-out
+  branch when off; record them with
+
+    trace-cmd record -e timing
+    perf record -e 'timing:*'
+
+  or through /sys/kernel/tracing/events/timing/.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM timing
+
+#if !defined(_TIMING_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TIMING_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* a sequence was queued behind the one playing */
+TRACE_EVENT(timing_submit,
+
+  TP_PROTO(int card, u32 num, size_t bytes, u32 cycles),
+
+  TP_ARGS(card, num, bytes, cycles),
+
+  TP_STRUCT__entry(
+    __field(int,    card)
+    __field(u32,    num)
+    __field(size_t, bytes)
+    __field(u32,    cycles)
+  ),
+
+  TP_fast_assign(
+    __entry->card   = card;
+    __entry->num    = num;
+    __entry->bytes  = bytes;
+    __entry->cycles = cycles;
+  ),
+
+  TP_printk("card=%d seq=%u bytes=%zu cycles=%u",
+	    __entry->card, __entry->num, __entry->bytes, __entry->cycles)
+);
+
+/* channel 1 was started, a refill or a whole chain */
+TRACE_EVENT(timing_dma_start,
+
+  TP_PROTO(int card, size_t bytes, size_t left, int chained),
+
+  TP_ARGS(card, bytes, left, chained),
+
+  TP_STRUCT__entry(
+    __field(int,    card)
+    __field(size_t, bytes)
+    __field(size_t, left)
+    __field(int,    chained)
+  ),
+
+  TP_fast_assign(
+    __entry->card    = card;
+    __entry->bytes   = bytes;
+    __entry->left    = left;
+    __entry->chained = chained;
+  ),
+
+  TP_printk("card=%d bytes=%zu left=%zu chained=%d",
+	    __entry->card, __entry->bytes, __entry->left, __entry->chained)
+);
+
+/* the DMA done interrupt */
+TRACE_EVENT(timing_dma_done,
+
+  TP_PROTO(int card, size_t bytes, s64 ns),
+
+  TP_ARGS(card, bytes, ns),
+
+  TP_STRUCT__entry(
+    __field(int,    card)
+    __field(size_t, bytes)
+    __field(s64,    ns)
+  ),
+
+  TP_fast_assign(
+    __entry->card  = card;
+    __entry->bytes = bytes;
+    __entry->ns    = ns;
+  ),
+
+  TP_printk("card=%d bytes=%zu ns=%lld",
+	    __entry->card, __entry->bytes, __entry->ns)
+);
+
+/* the wait Wt' and size of the next refill were decided */
+TRACE_EVENT(timing_dma_delay,
+
+  TP_PROTO(int card, u64 delay_ns, size_t next_bytes,
+	   u64 level_words, u64 low_words),
+
+  TP_ARGS(card, delay_ns, next_bytes, level_words, low_words),
+
+  TP_STRUCT__entry(
+    __field(int,    card)
+    __field(u64,    delay_ns)
+    __field(size_t, next_bytes)
+    __field(u64,    level_words)
+    __field(u64,    low_words)
+  ),
+
+  TP_fast_assign(
+    __entry->card        = card;
+    __entry->delay_ns    = delay_ns;
+    __entry->next_bytes  = next_bytes;
+    __entry->level_words = level_words;
+    __entry->low_words   = low_words;
+  ),
+
+  TP_printk("card=%d delay_ns=%llu next_bytes=%zu level=%llu low=%llu",
+	    __entry->card, __entry->delay_ns, __entry->next_bytes,
+	    __entry->level_words, __entry->low_words)
+);
+
+/* the kthread runs to reap played sequences */
+TRACE_EVENT(timing_kthread_wake,
+
+  TP_PROTO(int card, s64 latency_ns),
+
+  TP_ARGS(card, latency_ns),
+
+  TP_STRUCT__entry(
+    __field(int, card)
+    __field(s64, latency_ns)
+  ),
+
+  TP_fast_assign(
+    __entry->card       = card;
+    __entry->latency_ns = latency_ns;
+  ),
+
+  TP_printk("card=%d latency_ns=%lld",
+	    __entry->card, __entry->latency_ns)
+);
+
+/* the DO_CSR underrun flag was newly seen set */
+TRACE_EVENT(timing_underrun,
+
+  TP_PROTO(int card, u32 do_csr),
+
+  TP_ARGS(card, do_csr),
+
+  TP_STRUCT__entry(
+    __field(int, card)
+    __field(u32, do_csr)
+  ),
+
+  TP_fast_assign(
+    __entry->card   = card;
+    __entry->do_csr = do_csr;
+  ),
+
+  TP_printk("card=%d do_csr=0x%08x", __entry->card, __entry->do_csr)
+);
+
+#endif /* _TIMING_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE timing_trace
+#include <trace/define_trace.h>
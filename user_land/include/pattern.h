@@ -0,0 +1,38 @@
+#ifndef DEF_GUARD_PATTERN_H_
+#define DEF_GUARD_PATTERN_H_
+
+/*
+
+  Pattern generator mode. A sequence that loops forever
+  and is whole repeats of a period of at most a FIFO
+  (TIMING_PATTERN_MAX_WORDS words) is loaded into the
+  DO FIFO once and replayed by the card, with no DMA
+  and no CPU; anything else is streamed as usual.
+
+  NOTE --
+
+  After a pattern is loaded the output is enabled by a
+  DO_CSR write that keeps PAT_GEN_OCSR and does not
+  clear the FIFO. Nothing can be streamed until a DO_CSR
+  write without PAT_GEN_OCSR.
+
+ */
+
+#include <linux/types.h>
+
+/*
+  smallest period p of words[0, count), count a multiple
+  of p, if p <= max; 0 if there is none that short
+ */
+long pattern_period(const __u32 *words, long count, long max);
+
+/*
+  Queue words on fd (/dev/timing5) to play cycles times,
+  0 meaning until stopped. Returns 1 if it was loaded as
+  a pattern with do_csr (output off), 0 if it was queued
+  for DMA, -1 with errno set on error.
+ */
+int  pattern_play(int fd, const __u32 *words, long count, __u32 cycles,
+		  __u32 do_csr);
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef DEF_GUARD_TIMING_IOCTL_H_
+#define DEF_GUARD_TIMING_IOCTL_H_
+
+/*
+
+  ioctl interface shared by the timing driver and
+  user space. Only fixed width types so the layout
+  is the same on both sides.
+
+  NOTE --
+
+  The DO FIFO device (/dev/timing5) can be mmapped
+  (MAP_SHARED only, else EINVAL).
+  The mapping is the driver's DMA pool: pool_bufs
+  buffers of buf_size bytes laid end to end. Fill
+  it and then hand a region to TIMING_IOC_SUBMIT.
+  While any mapping exists, write() (unless it is
+  sent zero-copy) fails with EPERM, since it would
+  copy into buffers that may hold staged data.
+  Like writes (plain or async through aio or
+  io_uring), submissions are queued behind the
+  sequence playing; poll() for POLLOUT before
+  submitting on a non-blocking file.
+
+  TIMING_IOC_SET_CYCLES sets how many times each
+  sequence sent after it (by write or SUBMIT) is
+  played back to back, 0 meaning until
+  TIMING_IOC_STOP. The default is 1.
+
+  TIMING_IOC_START_AT (on /dev/timing1 or 5) writes
+  do_csr with the output enable bit set to the DO_CSR
+  at an absolute time, from an hrtimer. Queue the
+  sequence first so the FIFO is primed by then. A
+  time already past fails with ETIME.
+
+  TIMING_IOC_GET_STATS (any device of the card) reads
+  the DO stream counters, also in sysfs under the PCI
+  device's stats directory. TIMING_IOC_CLEAR_STATS
+  zeroes them.
+
+  TIMING_IOC_REG_BATCH (any device of the card) applies
+  an array of register operations in order, in one
+  call, with no other register writer in between.
+  Each op names a device of the card by its minor
+  offset (1 DO_CSR, 8-11 8254, 12 PLX LCR ...; not
+  the DO FIFO, 5). 7300 ports take width 4, the 8254
+  width 1, the PLX LCR width 1, 2 or 4 at reg. All
+  ops are checked first; a bad one fails the batch
+  with EINVAL before anything is written.
+
+  TIMING_IOC_STATUS (any device of the card) reads
+  the DI/DO/aux/interrupt CSRs, the three 8254
+  counters latched together by a read-back command,
+  and the PLX interrupt and DMA channel status in
+  one pass, plus the driver's queue position.
+
+  On the DI FIFO device (/dev/timing4)
+  TIMING_IOC_DI_START starts capturing into the
+  driver's ring by DMA and TIMING_IOC_DI_STOP stops
+  it. Meanwhile read() returns the samples; or mmap
+  the ring (block_count blocks of block_size bytes),
+  find the readable blocks with TIMING_IOC_DI_INFO
+  and hand them back with TIMING_IOC_DI_RELEASE.
+
+  TIMING_IOC_DUPLEX (on /dev/timing1, 4 or 5) starts
+  DI capture and then writes di_csr to the DI_CSR and
+  do_csr, enabled, to the DO_CSR back to back, either
+  at once (TIMING_DUPLEX_NOW, start_ns is returned)
+  or at the time in at. Queue the DO sequence first.
+  TIMING_IOC_START_TIME gives the CLOCK_MONOTONIC
+  time of the last output start, the time base of
+  both the DO and DI streams.
+
+  TIMING_IOC_SUBMIT_RLE (on /dev/timing5) queues a
+  sequence given as runs of one word repeated, like
+  a write of the words it expands to. The driver
+  keeps only the runs and expands each refill just
+  before sending it, so a long, mostly idle sequence
+  costs neither copying nor pool buffers. Runs of
+  repeat 0 are skipped.
+
+  The driver keeps a cache of sequences in its own DMA
+  memory (on /dev/timing5). TIMING_IOC_WAVE_LOAD copies
+  one in once and returns its id; TIMING_IOC_WAVE_PLAY
+  queues it by id like SUBMIT, with no copy, so
+  switching sequences is one small ioctl.
+  TIMING_IOC_WAVE_LIST lists the cache, least recently
+  played first, and TIMING_IOC_WAVE_EVICT drops one
+  (EBUSY while queued). When a load would take the
+  cache over its cap (wave_cache_kb) the least
+  recently played idle sequences are evicted.
+
+  TIMING_IOC_PATTERN (on /dev/timing5) stops the DO
+  stream and loads up to a FIFO of words straight into
+  the DO FIFO with the pattern generator bit set in
+  do_csr, so the card replays them on its own with no
+  DMA. The output is enabled at once with
+  TIMING_PATTERN_START, else by a DO_CSR write (or
+  TIMING_IOC_START_AT) that keeps the pattern bit and
+  doesn't clear the FIFO. Writes and submissions fail
+  with EBUSY until the pattern bit is cleared.
+
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define TIMING_IOC_MAGIC 't'
+
+/* geometry of the mmappable DMA pool */
+struct timing_pool_info {
+  __u32 buf_size;   /* bytes per pool buffer     */
+  __u32 buf_count;  /* number of pool buffers    */
+};
+
+/* "length bytes at offset in the pool are ready, send them" */
+struct timing_submit {
+  __u32 offset;     /* byte offset into the pool */
+  __u32 length;     /* bytes to send             */
+};
+
+/* clocks for struct timing_start_at */
+#define TIMING_CLOCK_REALTIME 0
+#define TIMING_CLOCK_TAI      1
+
+/* "enable the output at this instant" */
+struct timing_start_at {
+  __s64 tv_sec;     /* absolute time on clock    */
+  __u32 tv_nsec;
+  __u32 clock;      /* TIMING_CLOCK_*            */
+  __u32 do_csr;     /* DO_CSR value to write     */
+  __u32 reserved;
+};
+
+/* DO stream counters since load or TIMING_IOC_CLEAR_STATS */
+struct timing_stats {
+  __u64 transfers;     /* DMA transfers (chained: cycles) done */
+  __u64 bytes;         /* bytes they moved                     */
+  __u64 underruns;     /* DO_CSR underrun flag newly seen set  */
+  __u64 near_misses;   /* refills started under near_miss_us   */
+  __u64 stalls;        /* queue ran dry with output enabled    */
+  __s64 min_margin_ns; /* least FIFO time at a refill, -1 none */
+};
+
+/* one register access of a TIMING_IOC_REG_BATCH */
+#define TIMING_REG_READ     0x1   /* read instead of write     */
+#define TIMING_REG_READBACK 0x2   /* read after the write      */
+#define TIMING_REG_BATCH_MAX 256
+
+struct timing_reg_op {
+  __u8  port;       /* device within the card    */
+  __u8  width;      /* bytes: 1, 2 or 4          */
+  __u16 flags;      /* TIMING_REG_*              */
+  __u32 reg;        /* byte offset (PLX LCR)     */
+  __u32 value;      /* to write, or as read      */
+};
+
+struct timing_reg_batch {
+  __u64 ops;        /* struct timing_reg_op *    */
+  __u32 count;      /* ops in the array          */
+  __u32 reserved;
+};
+
+/* one pass over the card's status registers */
+#define TIMING_STATUS_RUNNING 0x1 /* DO stream is running     */
+#define TIMING_STATUS_OUTPUT  0x2 /* DO output is enabled     */
+#define TIMING_STATUS_PATTERN 0x4 /* DO FIFO replays a pattern */
+
+struct timing_status {
+  __u64 time_ns;            /* CLOCK_MONOTONIC at capture  */
+  __u32 di_csr;             /* 7300A ports 0-3             */
+  __u32 do_csr;
+  __u32 aux_dio;
+  __u32 int_csr;
+  __u16 counter[3];         /* 8254 counts, latched at once */
+  __u8  counter_status[3];  /* 8254 read-back status bytes  */
+  __u8  reserved0;
+  __u16 reserved1;
+  __u32 plx_intcsr;         /* PLX9080 INTCSR               */
+  __u8  plx_dmacsr0;        /* DMA channel 0 and 1 CSRs     */
+  __u8  plx_dmacsr1;
+  __u16 reserved2;
+  __u32 plx_dmasiz1;        /* channel 1 bytes left         */
+  __u32 plx_dmadpr1;        /* channel 1 descriptor pointer */
+  __u32 queue_head;         /* sequences played             */
+  __u32 queue_tail;         /* sequences submitted          */
+  __u32 flags;              /* TIMING_STATUS_*              */
+};
+
+/* DI capture ring state and overrun accounting */
+struct timing_di_info {
+  __u32 block_size;     /* bytes per ring block          */
+  __u32 block_count;    /* blocks in the ring            */
+  __u32 read_block;     /* oldest unread block           */
+  __u32 read_offset;    /* bytes of it read() already    */
+  __u32 available;      /* full blocks from read_block   */
+  __u32 running;        /* capture is on                 */
+  __u64 bytes;          /* captured since load           */
+  __u64 overruns;       /* blocks overwritten unread     */
+  __u64 overrun_bytes;
+};
+
+/* "start DI capture and DO output together" */
+#define TIMING_DUPLEX_NOW 0x1     /* now, not at 'at'          */
+
+struct timing_duplex {
+  struct timing_start_at at; /* when, and the DO_CSR     */
+  __u32 di_csr;     /* DI_CSR value, with DI enabled     */
+  __u32 flags;      /* TIMING_DUPLEX_*                   */
+  __s64 start_ns;   /* out: monotonic start, with NOW    */
+};
+
+/* "send word repeat times in a row", for TIMING_IOC_SUBMIT_RLE */
+#define TIMING_RLE_MAX_RUNS (1 << 18)
+
+struct timing_run {
+  __u32 word;       /* DO FIFO data, as written  */
+  __u32 repeat;     /* times in a row            */
+};
+
+struct timing_rle {
+  __u64 runs;       /* struct timing_run *       */
+  __u32 count;      /* runs in the array         */
+  __u32 reserved;
+};
+
+/* a sequence to keep in the driver's cache */
+#define TIMING_WAVE_NAME_LEN 32
+
+struct timing_wave_load {
+  __u64 data;       /* the words, as write() takes */
+  __u32 length;     /* bytes, a multiple of 4      */
+  __u32 id;         /* out: handle for PLAY/EVICT  */
+  char  name[TIMING_WAVE_NAME_LEN]; /* label only  */
+};
+
+/* one cached sequence, as TIMING_IOC_WAVE_LIST reports it */
+struct timing_wave_info {
+  __u32 id;
+  __u32 length;     /* bytes                       */
+  __u32 users;      /* times queued right now      */
+  __u32 reserved;
+  char  name[TIMING_WAVE_NAME_LEN];
+};
+
+struct timing_wave_list {
+  __u64 waves;      /* struct timing_wave_info *   */
+  __u32 count;      /* room in the array           */
+  __u32 total;      /* out: sequences cached       */
+  __u64 bytes;      /* out: memory they take       */
+  __u64 cap;        /* out: wave_cache_kb in bytes */
+};
+
+/* "replay these words from the FIFO", no DMA */
+#define TIMING_PATTERN_MAX_WORDS 16384    /* the DO FIFO     */
+#define TIMING_PATTERN_START     0x1      /* enable output   */
+
+struct timing_pattern {
+  __u64 words;      /* __u32 *, whole periods      */
+  __u32 length;     /* bytes                       */
+  __u32 do_csr;     /* DO_CSR to play with         */
+  __u32 flags;      /* TIMING_PATTERN_*            */
+  __u32 reserved;
+};
+
+#define TIMING_IOC_POOL_INFO  _IOR(TIMING_IOC_MAGIC, 1, struct timing_pool_info)
+#define TIMING_IOC_SUBMIT     _IOW(TIMING_IOC_MAGIC, 2, struct timing_submit)
+#define TIMING_IOC_SET_CYCLES _IOW(TIMING_IOC_MAGIC, 3, __u32)
+#define TIMING_IOC_STOP       _IO(TIMING_IOC_MAGIC, 4)
+#define TIMING_IOC_START_AT   _IOW(TIMING_IOC_MAGIC, 5, struct timing_start_at)
+#define TIMING_IOC_GET_STATS  _IOR(TIMING_IOC_MAGIC, 6, struct timing_stats)
+#define TIMING_IOC_CLEAR_STATS _IO(TIMING_IOC_MAGIC, 7)
+#define TIMING_IOC_REG_BATCH  _IOWR(TIMING_IOC_MAGIC, 8, struct timing_reg_batch)
+#define TIMING_IOC_STATUS     _IOR(TIMING_IOC_MAGIC, 9, struct timing_status)
+#define TIMING_IOC_DI_START   _IO(TIMING_IOC_MAGIC, 10)
+#define TIMING_IOC_DI_STOP    _IO(TIMING_IOC_MAGIC, 11)
+#define TIMING_IOC_DI_INFO    _IOR(TIMING_IOC_MAGIC, 12, struct timing_di_info)
+#define TIMING_IOC_DI_RELEASE _IOW(TIMING_IOC_MAGIC, 13, __u32)
+#define TIMING_IOC_DUPLEX     _IOWR(TIMING_IOC_MAGIC, 14, struct timing_duplex)
+#define TIMING_IOC_START_TIME _IOR(TIMING_IOC_MAGIC, 15, __s64)
+#define TIMING_IOC_SUBMIT_RLE _IOW(TIMING_IOC_MAGIC, 16, struct timing_rle)
+#define TIMING_IOC_WAVE_LOAD  _IOWR(TIMING_IOC_MAGIC, 17, struct timing_wave_load)
+#define TIMING_IOC_WAVE_PLAY  _IOW(TIMING_IOC_MAGIC, 18, __u32)
+#define TIMING_IOC_WAVE_EVICT _IOW(TIMING_IOC_MAGIC, 19, __u32)
+#define TIMING_IOC_WAVE_LIST  _IOWR(TIMING_IOC_MAGIC, 20, struct timing_wave_list)
+#define TIMING_IOC_PATTERN    _IOW(TIMING_IOC_MAGIC, 21, struct timing_pattern)
+
+#endif
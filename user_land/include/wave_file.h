@@ -0,0 +1,89 @@
+#ifndef DEF_GUARD_WAVE_FILE_H_
+#define DEF_GUARD_WAVE_FILE_H_
+
+/*
+
+  Precompiled DO sequence file. A fixed header says how
+  the card is to be clocked and how the sequence plays;
+  the data starts on a page boundary so the loader can
+  mmap the file and hand the mapping straight to the
+  driver: write() of the words, copied once from the
+  page cache into the driver's pool, or
+  TIMING_IOC_SUBMIT_RLE of the runs.
+
+  NOTE --
+
+  Everything is little endian, header and data, as the
+  card takes its FIFO words, so a file made on one host
+  plays the same on any other. Word data is the exact
+  image write() would take; RLE data is an array of
+  struct timing_run.
+
+ */
+
+#include <linux/types.h>
+#include "timing_ioctl.h"
+
+#define WAVE_FILE_MAGIC   0x56415754  /* "TWAV" */
+#define WAVE_FILE_VERSION 1
+#define WAVE_FILE_ALIGN   4096        /* data_offset multiple */
+
+/* data encodings */
+#define WAVE_DATA_WORDS   0
+#define WAVE_DATA_RLE     1
+
+/* DO clock sources, as in do_csr.h */
+#define WAVE_CLOCK_TIMER  0           /* 8254 counter 1 / divisor */
+#define WAVE_CLOCK_20MHZ  1
+#define WAVE_CLOCK_10MHZ  2
+#define WAVE_CLOCK_SHAKE  3           /* handshake */
+
+struct wave_file_header {
+
+  __u32 magic;
+  __u16 version;
+  __u16 header_size;  /* bytes, later versions may add    */
+  __u32 encoding;     /* WAVE_DATA_*                      */
+  __u32 clock;        /* WAVE_CLOCK_*                     */
+  __u32 fifo_width;   /* bytes per FIFO word, 2 or 4      */
+  __u32 divisor;      /* 8254 counter 1, WAVE_CLOCK_TIMER */
+  __u64 data_offset;  /* from the start of the file       */
+  __u64 data_size;    /* bytes of data                    */
+  __u64 words;        /* FIFO words in one cycle          */
+  __u32 cycles;       /* as TIMING_IOC_SET_CYCLES         */
+  __u32 reserved[3];
+
+};
+
+/* an open, mapped file; hdr in host byte order */
+typedef struct _wave_file {
+
+  int fd;
+  void *map;
+  size_t map_size;
+  struct wave_file_header hdr;
+  const void *data;   /* map + data_offset */
+
+} wave_file;
+
+/* write hdr (magic, version, sizes filled in) and data to path */
+int   wave_file_write(const char *path, struct wave_file_header *hdr,
+		      const void *data);
+
+/* map and check a file, 0 or -1 with errno set */
+int   wave_file_open(wave_file *wf, const char *path);
+void  wave_file_close(wave_file *wf);
+
+/* DO_CSR for the file's clock and width, output disabled */
+__u32 wave_file_do_csr(const wave_file *wf);
+
+/* program the DO_CSR and 8254 in one TIMING_IOC_REG_BATCH */
+int   wave_file_setup(const wave_file *wf, int fd);
+
+/*
+  queue the sequence on fd, /dev/timing5; 1 if it was
+  loaded in pattern generator mode instead (pattern.h)
+ */
+int   wave_file_play(const wave_file *wf, int fd);
+
+#endif
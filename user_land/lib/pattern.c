@@ -0,0 +1,100 @@
+/*
+  Pattern generator mode, see pattern.h
+
+  The period is found with the KMP failure function over
+  the first 2 * max words only: if the whole sequence has
+  a period p' <= max, that prefix has it too, and then
+  (Fine and Wilf) the prefix's smallest period p divides
+  p'. So p is checked against the whole sequence with one
+  memcmp; if it fails only the whole sequence can loop.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "../include/pattern.h"
+#include "../include/timing_ioctl.h"
+
+long pattern_period(const __u32 *words, long count, long max) {
+
+  long i, k, m, p;
+  long *fail;
+
+  if ( count <= 0 || max <= 0 )
+    return 0;
+
+  m = count < 2 * max ? count : 2 * max;
+
+  fail = malloc(m * sizeof(long));
+  if ( !fail )
+    return 0;
+
+  /* fail[i]: longest proper border of words[0, i] */
+  fail[0] = 0;
+  for ( i = 1, k = 0; i < m; i++ ) {
+    while ( k > 0 && words[i] != words[k] )
+      k = fail[k - 1];
+    if ( words[i] == words[k] )
+      k++;
+    fail[i] = k;
+  }
+
+  p = m - fail[m - 1];
+  free(fail);
+
+  /* every word equals the one a period before it */
+  if ( p <= max && !(count % p) &&
+       !memcmp(words + p, words, (count - p) * sizeof(__u32)) )
+    return p;
+
+  /* no shorter loop, but the whole thing may still fit */
+  return count <= max ? count : 0;
+} /* end pattern_period */
+
+int pattern_play(int fd, const __u32 *words, long count, __u32 cycles,
+		 __u32 do_csr) {
+
+  long i, p, n;
+  ssize_t rc;
+  __u32 *fifo;
+  struct timing_pattern pat;
+
+  p = cycles ? 0 : pattern_period(words, count, TIMING_PATTERN_MAX_WORDS);
+
+  if ( p ) {
+
+    /* as many whole periods as fit, so short ones aren't tiny */
+    n = TIMING_PATTERN_MAX_WORDS / p * p;
+    fifo = malloc(n * sizeof(__u32));
+    if ( !fifo )
+      return -1;
+    for ( i = 0; i < n; i += p )
+      memcpy(fifo + i, words, p * sizeof(__u32));
+
+    memset(&pat, 0, sizeof(pat));
+    pat.words  = (__u64)(unsigned long)fifo;
+    pat.length = n * sizeof(__u32);
+    pat.do_csr = do_csr;
+
+    rc = ioctl(fd, TIMING_IOC_PATTERN, &pat);
+    free(fifo);
+
+    return rc ? -1 : 1;
+  }
+
+  if ( ioctl(fd, TIMING_IOC_SET_CYCLES, &cycles) )
+    return -1;
+
+  /* one write is one sequence */
+  rc = write(fd, words, count * sizeof(__u32));
+  if ( rc < 0 )
+    return -1;
+  if ( rc != count * sizeof(__u32) ) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+} /* end pattern_play */
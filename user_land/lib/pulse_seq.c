@@ -0,0 +1,257 @@
+/*
+  Pulse sequence compiler, see pulse_seq.h
+
+  Every guard interval becomes two edges, on and off.
+  Compiling sorts them by position and records, with
+  each edge, the word output from there on (a bit is
+  on while any of its intervals is). Rendering finds
+  the last edge before the window with a binary search
+  and then fills whole runs between edges, so the cost
+  is the number of words plus the number of edges, not
+  words times channels.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../include/pulse_seq.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* runs at least this long bypass the cache (words) */
+#define PULSE_STREAM_WORDS (64 * 1024)
+
+/* room for n more edges */
+static int pulse_seq_grow(pulse_seq *seq, int n) {
+
+  int max;
+  pulse_edge *edges;
+
+  if ( seq->edge_count + n <= seq->edge_max )
+    return 0;
+
+  max = seq->edge_max ? seq->edge_max : 64;
+  while ( max < seq->edge_count + n )
+    max *= 2;
+
+  edges = realloc(seq->edges, max * sizeof(pulse_edge));
+  if ( !edges )
+    return -1;
+
+  seq->edges = edges;
+  seq->edge_max = max;
+
+  return 0;
+} /* end pulse_seq_grow */
+
+static int pulse_edge_cmp(const void *a, const void *b) {
+
+  long pa = ((const pulse_edge *)a)->pos;
+  long pb = ((const pulse_edge *)b)->pos;
+
+  return pa < pb ? -1 : pa > pb;
+} /* end pulse_edge_cmp */
+
+void pulse_seq_init(pulse_seq *seq) {
+
+  memset(seq, 0, sizeof(*seq));
+
+  return;
+} /* end pulse_seq_init */
+
+void pulse_seq_free(pulse_seq *seq) {
+
+  free(seq->edges);
+  pulse_seq_init(seq);
+
+  return;
+} /* end pulse_seq_free */
+
+int pulse_seq_mark(pulse_seq *seq, long pos, long len, __u32 mask) {
+
+  pulse_edge *e;
+
+  if ( len <= 0 || !mask )
+    return 0;
+
+  if ( pulse_seq_grow(seq, 2) )
+    return -1;
+
+  e = &seq->edges[seq->edge_count++];
+  e->pos  = pos;
+  e->mask = mask;
+  e->on   = 1;
+
+  e = &seq->edges[seq->edge_count++];
+  e->pos  = pos + len;
+  e->mask = mask;
+  e->on   = 0;
+
+  seq->compiled = 0;
+
+  return 0;
+} /* end pulse_seq_mark */
+
+int pulse_seq_add(pulse_seq *seq, const long *pulses, int pulse_count,
+		  const pulse_channel *chans, int chan_count) {
+
+  int p, c;
+
+  if ( pulse_seq_grow(seq, 2 * pulse_count * chan_count) )
+    return -1;
+
+  for ( p = 0; p < pulse_count; p++ )
+    for ( c = 0; c < chan_count; c++ )
+      pulse_seq_mark(seq, pulses[p] - chans[c].pre,
+		     chans[c].pre + chans[c].post, chans[c].mask);
+
+  return 0;
+} /* end pulse_seq_add */
+
+int pulse_seq_intervals(pulse_seq *seq, __u32 mask,
+			const pulse_interval *iv, int count) {
+
+  int i;
+
+  if ( pulse_seq_grow(seq, 2 * count) )
+    return -1;
+
+  for ( i = 0; i < count; i++ )
+    pulse_seq_mark(seq, iv[i].start, iv[i].end - iv[i].start, mask);
+
+  return 0;
+} /* end pulse_seq_intervals */
+
+/*
+   n copies of word at dst. Vector stores from the first
+   aligned address; a long run uses streaming stores, which
+   the caller must fence (pulse_fill_done) before the words
+   are read by anyone else.
+ */
+static void pulse_fill(__u32 *dst, __u32 word, long n) {
+
+#if defined(__AVX2__)
+  __m256i v;
+
+  for ( ; n > 0 && ((uintptr_t)dst & 31); n-- )
+    *dst++ = word;
+
+  v = _mm256_set1_epi32(word);
+  if ( n >= PULSE_STREAM_WORDS )
+    for ( ; n >= 8; n -= 8, dst += 8 )
+      _mm256_stream_si256((__m256i *)dst, v);
+  else
+    for ( ; n >= 8; n -= 8, dst += 8 )
+      _mm256_store_si256((__m256i *)dst, v);
+#elif defined(__SSE2__)
+  __m128i v;
+
+  for ( ; n > 0 && ((uintptr_t)dst & 15); n-- )
+    *dst++ = word;
+
+  v = _mm_set1_epi32(word);
+  if ( n >= PULSE_STREAM_WORDS )
+    for ( ; n >= 4; n -= 4, dst += 4 )
+      _mm_stream_si128((__m128i *)dst, v);
+  else
+    for ( ; n >= 4; n -= 4, dst += 4 )
+      _mm_store_si128((__m128i *)dst, v);
+#endif
+
+  for ( ; n > 0; n-- )
+    *dst++ = word;
+
+  return;
+} /* end pulse_fill */
+
+/* order streaming stores before anything after the render */
+static void pulse_fill_done(void) {
+
+#if defined(__AVX2__) || defined(__SSE2__)
+  _mm_sfence();
+#endif
+
+  return;
+} /* end pulse_fill_done */
+
+int pulse_seq_compile(pulse_seq *seq) {
+
+  int i, b;
+  int count[32];
+  __u32 word;
+
+  qsort(seq->edges, seq->edge_count, sizeof(pulse_edge), pulse_edge_cmp);
+
+  /* how many intervals hold each bit on */
+  memset(count, 0, sizeof(count));
+  word = 0;
+
+  for ( i = 0; i < seq->edge_count; i++ ) {
+
+    for ( b = 0; b < 32; b++ ) {
+
+      if ( !(seq->edges[i].mask & (0x1u << b)) )
+	continue;
+
+      count[b] += seq->edges[i].on ? 1 : -1;
+
+      if ( count[b] > 0 )
+	word |= 0x1u << b;
+      else
+	word &= ~(0x1u << b);
+    }
+
+    seq->edges[i].word = word;
+  }
+
+  seq->compiled = 1;
+
+  return 0;
+} /* end pulse_seq_compile */
+
+void pulse_seq_render(pulse_seq *seq, __u32 *words, long first, long count) {
+
+  int lo, hi, k;
+  long i, end, run;
+  __u32 word;
+
+  if ( !seq->compiled )
+    pulse_seq_compile(seq);
+
+  /* last edge at or before first, -1 if none */
+  lo = 0;
+  hi = seq->edge_count;
+  while ( lo < hi ) {
+    k = (lo + hi) / 2;
+    if ( seq->edges[k].pos <= first )
+      lo = k + 1;
+    else
+      hi = k;
+  }
+  k = lo - 1;
+
+  word = k >= 0 ? seq->edges[k].word : 0;
+  end = first + count;
+
+  for ( i = first; i < end; ) {
+
+    /* this word holds until the next edge */
+    run = k + 1 < seq->edge_count && seq->edges[k + 1].pos < end ?
+      seq->edges[k + 1].pos : end;
+
+    pulse_fill(words + (i - first), word, run - i);
+    i = run;
+
+    /* take every edge here, the last one has the word */
+    while ( k + 1 < seq->edge_count && seq->edges[k + 1].pos <= i ) {
+      k++;
+      word = seq->edges[k].word;
+    }
+  }
+
+  pulse_fill_done();
+
+  return;
+} /* end pulse_seq_render */
@@ -0,0 +1,293 @@
+/*
+  Precompiled sequence files, see wave_file.h
+
+  The whole file is mapped read only and shared, so the
+  words are only ever in the page cache: the driver
+  copies them from there into its pool, once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "../include/wave_file.h"
+#include "../include/do_csr.h"
+#include "../include/8254_timer.h"
+#include "../include/pattern.h"
+
+/* header between host and file order, either way */
+static void wave_header_swap(struct wave_file_header *h) {
+
+  h->magic       = htole32(h->magic);
+  h->version     = htole16(h->version);
+  h->header_size = htole16(h->header_size);
+  h->encoding    = htole32(h->encoding);
+  h->clock       = htole32(h->clock);
+  h->fifo_width  = htole32(h->fifo_width);
+  h->divisor     = htole32(h->divisor);
+  h->data_offset = htole64(h->data_offset);
+  h->data_size   = htole64(h->data_size);
+  h->words       = htole64(h->words);
+  h->cycles      = htole32(h->cycles);
+
+  return;
+} /* end wave_header_swap */
+
+/* all of buf or -1 */
+static int wave_write_all(int fd, const void *buf, size_t len) {
+
+  ssize_t rc;
+  const char *p = buf;
+
+  while ( len > 0 ) {
+    rc = write(fd, p, len);
+    if ( rc < 0 && errno == EINTR )
+      continue;
+    if ( rc <= 0 )
+      return -1;
+    p   += rc;
+    len -= rc;
+  }
+
+  return 0;
+} /* end wave_write_all */
+
+int wave_file_write(const char *path, struct wave_file_header *hdr,
+		    const void *data) {
+
+  int fd, rc;
+  char pad[WAVE_FILE_ALIGN];
+  struct wave_file_header out;
+
+  hdr->magic       = WAVE_FILE_MAGIC;
+  hdr->version     = WAVE_FILE_VERSION;
+  hdr->header_size = sizeof(*hdr);
+  hdr->data_offset = WAVE_FILE_ALIGN;
+  memset(hdr->reserved, 0, sizeof(hdr->reserved));
+
+  out = *hdr;
+  wave_header_swap(&out);
+
+  /* header, then zeros up to the first page of data */
+  memset(pad, 0, sizeof(pad));
+  memcpy(pad, &out, sizeof(out));
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ( fd < 0 )
+    return -1;
+
+  rc = wave_write_all(fd, pad, sizeof(pad));
+  if ( !rc )
+    rc = wave_write_all(fd, data, hdr->data_size);
+
+  if ( close(fd) )
+    rc = -1;
+
+  return rc;
+} /* end wave_file_write */
+
+/* is the header one we can play */
+static int wave_header_check(const struct wave_file_header *h,
+			     size_t file_size) {
+
+  if ( h->magic != WAVE_FILE_MAGIC || h->version != WAVE_FILE_VERSION ||
+       h->header_size < sizeof(*h) )
+    return -1;
+
+  if ( h->fifo_width != 2 && h->fifo_width != 4 )
+    return -1;
+  if ( h->clock > WAVE_CLOCK_SHAKE )
+    return -1;
+  if ( h->clock == WAVE_CLOCK_TIMER && (!h->divisor || h->divisor > 0xffff) )
+    return -1;
+
+  /* data on its own pages and all in the file */
+  if ( h->data_offset < h->header_size ||
+       h->data_offset % WAVE_FILE_ALIGN ||
+       h->data_offset > file_size ||
+       h->data_size > file_size - h->data_offset || !h->data_size )
+    return -1;
+
+  switch ( h->encoding ) {
+
+  case WAVE_DATA_WORDS:
+    return h->data_size % 4 ? -1 : 0;
+
+  case WAVE_DATA_RLE:
+
+    /* runs are read in place by the driver */
+    if ( __BYTE_ORDER != __LITTLE_ENDIAN )
+      return -1;
+    return h->data_size % sizeof(struct timing_run) ||
+      h->data_size / sizeof(struct timing_run) > TIMING_RLE_MAX_RUNS ? -1 : 0;
+  }
+
+  return -1;
+} /* end wave_header_check */
+
+int wave_file_open(wave_file *wf, const char *path) {
+
+  int err;
+  struct stat st;
+
+  memset(wf, 0, sizeof(*wf));
+
+  wf->fd = open(path, O_RDONLY);
+  if ( wf->fd < 0 )
+    return -1;
+
+  if ( fstat(wf->fd, &st) )
+    goto fail;
+
+  errno = EINVAL;
+  if ( st.st_size < sizeof(struct wave_file_header) )
+    goto fail;
+
+  wf->map_size = st.st_size;
+  wf->map = mmap(NULL, wf->map_size, PROT_READ, MAP_SHARED, wf->fd, 0);
+  if ( wf->map == MAP_FAILED ) {
+    wf->map = NULL;
+    goto fail;
+  }
+
+  memcpy(&wf->hdr, wf->map, sizeof(wf->hdr));
+  wave_header_swap(&wf->hdr);
+
+  errno = EINVAL;
+  if ( wave_header_check(&wf->hdr, wf->map_size) )
+    goto fail;
+
+  wf->data = (const char *)wf->map + wf->hdr.data_offset;
+
+  /* it is about to be read front to back */
+  madvise((char *)wf->map + wf->hdr.data_offset, wf->hdr.data_size,
+	  MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  return 0;
+
+ fail:
+  err = errno;
+  wave_file_close(wf);
+  errno = err;
+  return -1;
+} /* end wave_file_open */
+
+void wave_file_close(wave_file *wf) {
+
+  if ( wf->map )
+    munmap(wf->map, wf->map_size);
+  if ( wf->fd >= 0 )
+    close(wf->fd);
+
+  wf->map = NULL;
+  wf->data = NULL;
+  wf->fd = -1;
+
+  return;
+} /* end wave_file_close */
+
+__u32 wave_file_do_csr(const wave_file *wf) {
+
+  __u32 cmd;
+
+  RESET_OCSR(cmd);
+
+  if ( wf->hdr.fifo_width == 4 )
+    WIDTH_32_OCSR(cmd);
+  else
+    WIDTH_NOT32_OCSR(cmd);
+
+  switch ( wf->hdr.clock ) {
+  case WAVE_CLOCK_20MHZ: CLOCK_20MHZ_OCSR(cmd); break;
+  case WAVE_CLOCK_10MHZ: CLOCK_10MHZ_OCSR(cmd); break;
+  case WAVE_CLOCK_SHAKE: CLOCK_SHAKE_OCSR(cmd); break;
+  default:               CLOCK_TIMER_OCSR(cmd); break;
+  }
+
+  NO_PAT_GEN_OCSR(cmd);
+  DISABLE_OCSR(cmd);
+  TERM_OFF_OCSR(cmd);
+  CLEAR_FIFO_OCSR(cmd);
+  NO_WAIT_NAE_OCSR(cmd);
+  NO_TRIG_OCSR(cmd);
+  NO_TRIG_END_OCSR(cmd);
+  CLEAR_UNDER_OCSR(cmd);
+  NO_SHAKE_OCSR(cmd);
+
+  return cmd;
+} /* end wave_file_do_csr */
+
+int wave_file_setup(const wave_file *wf, int fd) {
+
+  int n;
+  unsigned char timer;
+  struct timing_reg_op ops[4];
+  struct timing_reg_batch batch;
+
+  memset(ops, 0, sizeof(ops));
+  n = 0;
+
+  /* output off and FIFO cleared with the new clock and width */
+  ops[n].port  = 1;
+  ops[n].width = 4;
+  ops[n].value = wave_file_do_csr(wf);
+  n++;
+
+  /* counter 1 divides the timer clock down to the DO clock */
+  if ( wf->hdr.clock == WAVE_CLOCK_TIMER ) {
+
+    timer = 0x00;
+    MODE_2_8254(timer);
+    BINARY_8254(timer);
+    LSB_TO_MSB_8254(timer);
+    COUNTER_1_8254(timer);
+
+    ops[n].port  = 11;
+    ops[n].width = 1;
+    ops[n].value = timer;
+    n++;
+
+    ops[n].port  = 9;
+    ops[n].width = 1;
+    ops[n].value = wf->hdr.divisor & 0xff;
+    n++;
+
+    ops[n].port  = 9;
+    ops[n].width = 1;
+    ops[n].value = (wf->hdr.divisor >> 8) & 0xff;
+    n++;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  batch.ops   = (__u64)(unsigned long)ops;
+  batch.count = n;
+
+  return ioctl(fd, TIMING_IOC_REG_BATCH, &batch);
+} /* end wave_file_setup */
+
+int wave_file_play(const wave_file *wf, int fd) {
+
+  __u32 cycles;
+  struct timing_rle rle;
+
+  /* a short loop goes to the FIFO once, else straight */
+  /* from the mapping, one write being one sequence    */
+  if ( wf->hdr.encoding == WAVE_DATA_WORDS )
+    return pattern_play(fd, wf->data, wf->hdr.data_size / 4,
+			wf->hdr.cycles, wave_file_do_csr(wf));
+
+  cycles = wf->hdr.cycles;
+  if ( ioctl(fd, TIMING_IOC_SET_CYCLES, &cycles) )
+    return -1;
+
+  memset(&rle, 0, sizeof(rle));
+  rle.runs  = (__u64)(unsigned long)wf->data;
+  rle.count = wf->hdr.data_size / sizeof(struct timing_run);
+
+  return ioctl(fd, TIMING_IOC_SUBMIT_RLE, &rle);
+} /* end wave_file_play */
@@ -5,6 +5,7 @@
 #include <linux/types.h>
 #include "../../include/do_csr.h"
 #include "../../include/8254_timer.h"
+#include "../../include/pulse_seq.h"
 
 #define ATT (0x1 << 15) /* yellow */
 #define TR  (0x1 << 14) /* blue */
@@ -18,7 +19,6 @@
 int main(void) {
 
   __u32 cmd;
-  __u32 word;
   __u32 *fifo;
 
   FILE *outfile;
@@ -30,6 +30,10 @@ int main(void) {
   int DO_CSR, DO_FIFO, TIMER_CTRL, TIMER_1, PLX_9080;
 
   int ptab[PULSE_NUM] = { 0, 14, 22, 24, 27, 31, 42, 43 };
+  long pulses[PULSE_NUM];
+
+  pulse_seq seq;
+  pulse_channel chans[3];
 
   /* values in microseconds */
   int tau = 1500;
@@ -46,53 +50,40 @@ int main(void) {
   /* allocate space for array */
   fifo = (__u32*) malloc(SIXTEEN_K * sizeof(__u32));
 
-  /* zero the array */
-  word = 0x00;
-  for ( i = 0; i < SIXTEEN_K; i++ )
-    fifo[i] = word;
-
-  /* push 1 tau for buffer in the front */
+  /*
+     push 1 tau for buffer in the front; each channel is on
+     from just after (pulse - pre) through (pulse + post), so
+     in pulse_seq's half open terms the pulse is one word on
+  */
   for ( i = 0; i < PULSE_NUM; i++ )
-    ptab[i]++;
+    pulses[i] = (ptab[i] + 1) * tau + 1;
 
-  /* for each word of the buffer */
-  for ( j = 0, i = 0; i < SIXTEEN_K; i++ ) {
- 
-    /* start with zero */
-    word = 0x00;
-
-    /* 0 after all of the pulses */
-    if ( j >= PULSE_NUM ) {
-      fifo[i] = word;
-      continue;
-    }
-
-    /* generate scope sync */
-    if ( i == 1 )
-      word |= SS;
-
-    /* check for attenuator bit */
-    if ( (i > ((ptab[j] * tau) - tr_buffer - att_buffer)) &&
-	 (i <= ((ptab[j] * tau) + tr_buffer + att_buffer + tx_duration)) )
-      word |= ATT;
-
-    /* check for TR bit */
-    if ( (i > ((ptab[j] * tau) - tr_buffer)) && 
-	 (i <= ((ptab[j] * tau) + tr_buffer + tx_duration)) )
-      word |= TR;
-
-    /* check for TX bit */
-    if ( (i > (ptab[j] * tau)) && (i <= (ptab[j] * tau) + tx_duration) )
-      word |= TX;
-
-    /* when we should move over to the next pulse... */
-    if ( i == ((ptab[j] * tau) + tr_buffer + att_buffer + tx_duration) )
-      j++;
-
-    /* save the collection */
-    fifo[i] = word;
+  /* attenuator, TR switch and transmitter guards */
+  chans[0].mask = ATT;
+  chans[0].pre  = tr_buffer + att_buffer;
+  chans[0].post = tr_buffer + att_buffer + tx_duration;
+
+  chans[1].mask = TR;
+  chans[1].pre  = tr_buffer;
+  chans[1].post = tr_buffer + tx_duration;
+
+  chans[2].mask = TX;
+  chans[2].pre  = 0;
+  chans[2].post = tx_duration;
+
+  /* compile the edges, then fill the FIFO image run by run */
+  pulse_seq_init(&seq);
+
+  if ( pulse_seq_mark(&seq, 1, 1, SS) ||
+       pulse_seq_add(&seq, pulses, PULSE_NUM, chans, 3) ||
+       pulse_seq_compile(&seq) ) {
+    printf("couldn't compile pulse sequence \n");
+    exit(2);
   }
 
+  pulse_seq_render(&seq, fifo, 0, SIXTEEN_K);
+  pulse_seq_free(&seq);
+
   /* output the test file */
   outfile = fopen("test_result.txt", "w");
 
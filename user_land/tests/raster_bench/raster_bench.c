@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/types.h>
+#include "../../include/pulse_seq.h"
+
+/*
+  Times rasterizing a long DO sequence: the per word loop
+  fake_tsg.c used to have, against pulse_seq built from a
+  pulse table (pulse_seq_add) and from per channel
+  interval lists (pulse_seq_intervals). The render of the
+  compiled edges is also timed on its own, with the
+  library's fill (SIMD if built with it) and with a plain
+  C loop over the same runs, to show what the vector
+  stores add on top of the run structure. Every image is
+  compared word for word with the old loop's.
+
+  usage: x_bench [seconds [clock_MHz [pulse_us]]]
+ */
+
+#define ATT (0x1 << 15) /* yellow */
+#define TR  (0x1 << 14) /* blue */
+#define TX  (0x1 << 13) /* pink */ 
+#define SS  (0x1 << 12) /* green */
+
+#define RUNS 5
+
+/* the old loop: every channel tested for every word */
+static void raster_scalar(__u32 *fifo, long words, const long *ptab,
+			  int pulse_num, long tr, long att, long tx) {
+
+  long i;
+  int j;
+  __u32 word;
+
+  for ( j = 0, i = 0; i < words; i++ ) {
+
+    word = 0x00;
+
+    if ( j >= pulse_num ) {
+      fifo[i] = word;
+      continue;
+    }
+
+    if ( i == 1 )
+      word |= SS;
+
+    if ( (i > ptab[j] - tr - att) && (i <= ptab[j] + tr + att + tx) )
+      word |= ATT;
+
+    if ( (i > ptab[j] - tr) && (i <= ptab[j] + tr + tx) )
+      word |= TR;
+
+    if ( (i > ptab[j]) && (i <= ptab[j] + tx) )
+      word |= TX;
+
+    if ( i == ptab[j] + tr + att + tx )
+      j++;
+
+    fifo[i] = word;
+  }
+
+  return;
+} /* end raster_scalar */
+
+/* the same sequence compiled from the pulse table */
+static int build_seq(pulse_seq *seq, const long *ptab, int pulse_num,
+		     long tr, long att, long tx) {
+
+  int i, rc;
+  long *pulses;
+  pulse_channel chans[3];
+
+  pulses = malloc(pulse_num * sizeof(long));
+  if ( !pulses )
+    return -1;
+
+  /* window (c - pre, c + post] is [c + 1 - pre, c + 1 + post) */
+  for ( i = 0; i < pulse_num; i++ )
+    pulses[i] = ptab[i] + 1;
+
+  chans[0].mask = ATT;
+  chans[0].pre  = tr + att;
+  chans[0].post = tr + att + tx;
+
+  chans[1].mask = TR;
+  chans[1].pre  = tr;
+  chans[1].post = tr + tx;
+
+  chans[2].mask = TX;
+  chans[2].pre  = 0;
+  chans[2].post = tx;
+
+  pulse_seq_init(seq);
+
+  rc = pulse_seq_mark(seq, 1, 1, SS) ||
+    pulse_seq_add(seq, pulses, pulse_num, chans, 3) ||
+    pulse_seq_compile(seq);
+
+  free(pulses);
+
+  return rc ? -1 : 0;
+} /* end build_seq */
+
+/* and from each channel's own interval list */
+static int build_intervals(pulse_seq *seq, const long *ptab, int pulse_num,
+			   long tr, long att, long tx) {
+
+  int i, c, rc;
+  pulse_interval *iv;
+  const __u32 mask[3] = { ATT, TR, TX };
+  const long pre[3]   = { tr + att, tr, 0 };
+  const long post[3]  = { tr + att + tx, tr + tx, tx };
+
+  iv = malloc((pulse_num > 0 ? pulse_num : 1) * sizeof(pulse_interval));
+  if ( !iv )
+    return -1;
+
+  pulse_seq_init(seq);
+
+  rc = pulse_seq_mark(seq, 1, 1, SS);
+
+  for ( c = 0; c < 3 && !rc; c++ ) {
+    for ( i = 0; i < pulse_num; i++ ) {
+      iv[i].start = ptab[i] + 1 - pre[c];
+      iv[i].end   = ptab[i] + 1 + post[c];
+    }
+    rc = pulse_seq_intervals(seq, mask[c], iv, pulse_num);
+  }
+
+  if ( !rc )
+    rc = pulse_seq_compile(seq);
+
+  free(iv);
+
+  return rc ? -1 : 0;
+} /* end build_intervals */
+
+/*
+   The runs pulse_seq_render fills, filled one word at a
+   time. Kept from being vectorized or turned into memset
+   so it stays the plain C baseline.
+ */
+__attribute__((optimize("no-tree-vectorize",
+			"no-tree-loop-distribute-patterns")))
+static void render_plain(const pulse_seq *seq, __u32 *fifo, long words) {
+
+  int k;
+  long i, run;
+  __u32 word;
+
+  word = 0;
+  for ( k = 0, i = 0; i < words; ) {
+
+    while ( k < seq->edge_count && seq->edges[k].pos <= i )
+      word = seq->edges[k++].word;
+
+    run = k < seq->edge_count && seq->edges[k].pos < words ?
+      seq->edges[k].pos : words;
+
+    for ( ; i < run; i++ )
+      fifo[i] = word;
+  }
+
+  return;
+} /* end render_plain */
+
+static double now_ms(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+} /* end now_ms */
+
+/* keep the best of RUNS */
+static void best(double *b, double t0) {
+
+  double t = now_ms() - t0;
+
+  if ( t < *b )
+    *b = t;
+
+  return;
+} /* end best */
+
+static void report(const char *what, double ms, double mb) {
+
+  printf("  %-24s %9.2f ms %9.1f MB/s \n", what, ms, mb / ms * 1e3);
+
+  return;
+} /* end report */
+
+int main(int argc, char **argv) {
+
+  int i, r, pulse_num;
+  long words, tau, tr, att, tx;
+  long *ptab;
+  __u32 *a, *b;
+  double t, mb;
+  double t_scalar, t_seq, t_iv, t_fill, t_plain;
+  pulse_seq seq;
+
+  double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+  double mhz     = argc > 2 ? atof(argv[2]) : 20.0;
+  double pri_us  = argc > 3 ? atof(argv[3]) : 1500.0;
+
+  /* fake_tsg's guards, in clock periods at mhz */
+  words = (long)(seconds * mhz * 1e6);
+  tau   = (long)(pri_us * mhz);
+  tr    = (long)(150 * mhz);
+  att   = (long)(100 * mhz);
+  tx    = (long)(300 * mhz);
+
+  if ( words < 2 || tau <= 2 * (tr + att) + tx ) {
+    printf("bad arguments \n");
+    exit(1);
+  }
+
+  /* one pulse per tau, 1 tau of buffer in front */
+  pulse_num = words / tau - 1;
+  ptab = malloc((pulse_num > 0 ? pulse_num : 1) * sizeof(long));
+  a = malloc(words * sizeof(__u32));
+  b = malloc(words * sizeof(__u32));
+  if ( !ptab || !a || !b ) {
+    printf("couldn't allocate %ld words \n", words);
+    exit(1);
+  }
+
+  for ( i = 0; i < pulse_num; i++ )
+    ptab[i] = (i + 1) * tau;
+
+  /* first pass also pages the buffers in */
+  t_scalar = t_seq = t_iv = t_fill = t_plain = 1e30;
+  for ( r = 0; r < RUNS; r++ ) {
+
+    t = now_ms();
+    raster_scalar(a, words, ptab, pulse_num, tr, att, tx);
+    best(&t_scalar, t);
+
+    /* pulse table: build, compile and render */
+    t = now_ms();
+    if ( build_seq(&seq, ptab, pulse_num, tr, att, tx) ) {
+      printf("couldn't compile pulse sequence \n");
+      exit(2);
+    }
+    pulse_seq_render(&seq, b, 0, words);
+    best(&t_seq, t);
+
+    if ( memcmp(a, b, words * sizeof(__u32)) ) {
+      printf("pulse_seq_add image differs \n");
+      exit(3);
+    }
+
+    /* the render alone, library fill against plain C */
+    memset(b, 0xff, words * sizeof(__u32));
+    t = now_ms();
+    pulse_seq_render(&seq, b, 0, words);
+    best(&t_fill, t);
+
+    memset(b, 0xff, words * sizeof(__u32));
+    t = now_ms();
+    render_plain(&seq, b, words);
+    best(&t_plain, t);
+
+    if ( memcmp(a, b, words * sizeof(__u32)) ) {
+      printf("plain render differs \n");
+      exit(3);
+    }
+
+    pulse_seq_free(&seq);
+
+    /* per channel interval lists: build, compile and render */
+    memset(b, 0xff, words * sizeof(__u32));
+    t = now_ms();
+    if ( build_intervals(&seq, ptab, pulse_num, tr, att, tx) ) {
+      printf("couldn't compile interval lists \n");
+      exit(2);
+    }
+    pulse_seq_render(&seq, b, 0, words);
+    best(&t_iv, t);
+    pulse_seq_free(&seq);
+
+    if ( memcmp(a, b, words * sizeof(__u32)) ) {
+      printf("pulse_seq_intervals image differs \n");
+      exit(3);
+    }
+  }
+
+  mb = words * sizeof(__u32) / 1e6;
+
+  printf("%ld words (%.1f s at %.1f MHz), %d pulses, best of %d \n",
+	 words, seconds, mhz, pulse_num, RUNS);
+  printf("  fill built for: %s \n",
+#if defined(__AVX2__)
+	 "AVX2"
+#elif defined(__SSE2__)
+	 "SSE2"
+#else
+	 "plain C"
+#endif
+	 );
+  report("scalar loop:", t_scalar, mb);
+  report("pulse_seq_add:", t_seq, mb);
+  report("pulse_seq_intervals:", t_iv, mb);
+  report("render, library fill:", t_fill, mb);
+  report("render, plain C fill:", t_plain, mb);
+  printf("  runs vs scalar loop:      %9.1fx \n", t_scalar / t_seq);
+  printf("  library vs plain fill:    %9.2fx \n", t_plain / t_fill);
+
+  free(ptab);
+  free(a);
+  free(b);
+
+  return 0;
+} /* end main */
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/types.h>
+#include "../../include/pulse_seq.h"
+#include "../../include/wave_file.h"
+
+/*
+  Compiles fake_tsg's pulse table into fake_tsg.twav
+  (words) and fake_tsg_rle.twav (runs), for x_wave_play.
+ */
+
+#define ATT (0x1 << 15) /* yellow */
+#define TR  (0x1 << 14) /* blue */
+#define TX  (0x1 << 13) /* pink */ 
+#define SS  (0x1 << 12) /* green */
+
+#define PULSE_NUM 8
+#define SIXTEEN_K 16*1024
+#define CLOCK_PERIOD_US 10
+
+int main(void) {
+
+  __u32 *fifo;
+  struct timing_run *runs;
+  struct wave_file_header hdr;
+
+  int i, n;
+
+  int ptab[PULSE_NUM] = { 0, 14, 22, 24, 27, 31, 42, 43 };
+  long pulses[PULSE_NUM];
+
+  pulse_seq seq;
+  pulse_channel chans[3];
+
+  /* values in clock periods, as fake_tsg */
+  int tau         = 1500 / CLOCK_PERIOD_US;
+  int tr_buffer   = 150  / CLOCK_PERIOD_US;
+  int att_buffer  = 100  / CLOCK_PERIOD_US;
+  int tx_duration = 300  / CLOCK_PERIOD_US;
+
+  fifo = malloc(SIXTEEN_K * sizeof(__u32));
+  runs = malloc(SIXTEEN_K * sizeof(struct timing_run));
+  if ( !fifo || !runs ) {
+    printf("couldn't allocate memory \n");
+    exit(1);
+  }
+
+  for ( i = 0; i < PULSE_NUM; i++ )
+    pulses[i] = (ptab[i] + 1) * tau + 1;
+
+  chans[0].mask = ATT;
+  chans[0].pre  = tr_buffer + att_buffer;
+  chans[0].post = tr_buffer + att_buffer + tx_duration;
+
+  chans[1].mask = TR;
+  chans[1].pre  = tr_buffer;
+  chans[1].post = tr_buffer + tx_duration;
+
+  chans[2].mask = TX;
+  chans[2].pre  = 0;
+  chans[2].post = tx_duration;
+
+  pulse_seq_init(&seq);
+
+  if ( pulse_seq_mark(&seq, 1, 1, SS) ||
+       pulse_seq_add(&seq, pulses, PULSE_NUM, chans, 3) ||
+       pulse_seq_compile(&seq) ) {
+    printf("couldn't compile pulse sequence \n");
+    exit(2);
+  }
+
+  pulse_seq_render(&seq, fifo, 0, SIXTEEN_K);
+  pulse_seq_free(&seq);
+
+  /* 8254 counter 1 at 100: a 10 us period, as fake_tsg */
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.encoding   = WAVE_DATA_WORDS;
+  hdr.clock      = WAVE_CLOCK_TIMER;
+  hdr.fifo_width = 4;
+  hdr.divisor    = 100;
+  hdr.data_size  = SIXTEEN_K * sizeof(__u32);
+  hdr.words      = SIXTEEN_K;
+  hdr.cycles     = 1;
+
+  if ( wave_file_write("fake_tsg.twav", &hdr, fifo) ) {
+    perror("fake_tsg.twav");
+    exit(3);
+  }
+
+  /* the same image as runs */
+  for ( i = 0, n = 0; i < SIXTEEN_K; i++ ) {
+    if ( n && runs[n - 1].word == fifo[i] )
+      runs[n - 1].repeat++;
+    else {
+      runs[n].word   = fifo[i];
+      runs[n].repeat = 1;
+      n++;
+    }
+  }
+
+  hdr.encoding  = WAVE_DATA_RLE;
+  hdr.data_size = n * sizeof(struct timing_run);
+
+  if ( wave_file_write("fake_tsg_rle.twav", &hdr, runs) ) {
+    perror("fake_tsg_rle.twav");
+    exit(3);
+  }
+
+  printf("%d words, %d runs \n", SIXTEEN_K, n);
+
+  free(fifo);
+  free(runs);
+
+  return 0;
+}
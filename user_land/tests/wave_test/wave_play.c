@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <linux/types.h>
+#include "../../include/do_csr.h"
+#include "../../include/wave_file.h"
+
+/*
+  usage: x_wave_play file.twav
+
+  Sets the card up as the file says, queues the sequence
+  straight from the mapped file (or loads it as a pattern
+  if it is a short loop) and enables the output.
+ */
+
+int main(int argc, char **argv) {
+
+  __u32 cmd;
+  wave_file wf;
+
+  int rc;
+  int DO_CSR, DO_FIFO;
+
+  if ( argc != 2 ) {
+    printf("usage: %s file.twav \n", argv[0]);
+    exit(1);
+  }
+
+  if ( wave_file_open(&wf, argv[1]) ) {
+    perror(argv[1]);
+    exit(2);
+  }
+
+  printf("%llu words, %s, %u cycles \n",
+	 (unsigned long long)wf.hdr.words,
+	 wf.hdr.encoding == WAVE_DATA_RLE ? "runs" : "words",
+	 wf.hdr.cycles);
+
+  DO_FIFO = open("/dev/timing5", O_WRONLY);
+  DO_CSR  = open("/dev/timing1", O_WRONLY);
+
+  if ( DO_FIFO < 1 || DO_CSR < 1 ) {
+    printf("couldn't open devices \n");
+    exit(3);
+  }
+
+  if ( wave_file_setup(&wf, DO_FIFO) ) {
+    perror("setup");
+    exit(4);
+  }
+
+  rc = wave_file_play(&wf, DO_FIFO);
+  if ( rc < 0 ) {
+    perror("play");
+    exit(4);
+  }
+
+  /* let the FIFO fill */
+  if ( !rc )
+    sleep(1);
+
+  /* begin output, the card replays a pattern by itself */
+  cmd = wave_file_do_csr(&wf);
+  if ( rc > 0 )
+    PAT_GEN_OCSR(cmd);
+  SAVE_FIFO_OCSR(cmd);
+  ENABLE_OCSR(cmd);
+
+  write(DO_CSR, &cmd, sizeof(__u32));
+
+  close(DO_CSR);
+  close(DO_FIFO);
+  wave_file_close(&wf);
+
+  return 0;
+}